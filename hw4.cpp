@@ -1,13 +1,49 @@
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
 #include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <cstdio>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <iterator>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <sstream>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
 class YUVImage;
 class GSCImage;
 
@@ -16,27 +52,29 @@ public:
   virtual ~Pixel() = default;
 };
 
+// Grayscale and RGB samples are 16 bits wide so that images with a maxval
+// above 255 keep their full depth.
 class GSCPixel : public Pixel {
 private:
-  unsigned char value;
+  uint16_t value;
 
 public:
   GSCPixel() = default;
 
   GSCPixel(const GSCPixel &p) { value = p.value; }
 
-  GSCPixel(unsigned char value) { this->value = value; }
+  GSCPixel(uint16_t value) { this->value = value; }
 
-  unsigned char getValue() const { return value; }
+  uint16_t getValue() const { return value; }
 
-  void setValue(unsigned char value) { this->value = value; }
+  void setValue(uint16_t value) { this->value = value; }
 };
 
 class RGBPixel : public Pixel {
 private:
-  unsigned char red;
-  unsigned char green;
-  unsigned char blue;
+  uint16_t red;
+  uint16_t green;
+  uint16_t blue;
 
 public:
   RGBPixel() = default;
@@ -47,7 +85,7 @@ public:
     blue = p.blue;
   }
 
-  RGBPixel(unsigned char r, unsigned char g, unsigned char b) {
+  RGBPixel(uint16_t r, uint16_t g, uint16_t b) {
     red = r;
     green = g;
     blue = b;
@@ -59,11 +97,11 @@ public:
 
   int getBlue() const { return blue; }
 
-  void setRed(unsigned char r) { red = r; }
+  void setRed(uint16_t r) { red = r; }
 
-  void setGreen(unsigned char g) { green = g; }
+  void setGreen(uint16_t g) { green = g; }
 
-  void setBlue(unsigned char b) { blue = b; }
+  void setBlue(uint16_t b) { blue = b; }
 };
 
 class YUVPixel : public Pixel {
@@ -100,1053 +138,6922 @@ public:
   void setV(unsigned char v) { this->v = v; }
 };
 
-class Image {
-protected:
-  int width;
-  int height;
-  int max_luminocity;
-
-public:
-  virtual ~Image() {}
-  int getWidth() const { return width; }
-  int getHeight() const { return height; }
-  int getMaxLuminocity() const { return max_luminocity; }
-  void setWidth(int width) { this->width = width; }
-  void setHeight(int height) { this->height = height; }
-  void setMaxLuminocity(int lum) { this->max_luminocity = lum; }
-
-  virtual Image &operator+=(int times) = 0;
-  virtual Image &operator*=(double factor) = 0;
-  virtual Image &operator!() = 0;
-  virtual Image &operator~() = 0;
-  virtual Image &operator*() = 0;
-  virtual Pixel &getPixel(int row, int col) const = 0;
-
-  friend std::ostream &operator<<(std::ostream &out, Image &image);
-};
-
-class RGBImage : public Image {
+// Recycles the large buffers behind images and planes. Most commands free
+// blocks of the sizes the next one asks for (the image being replaced, the
+// planes of the previous kernel), so freed blocks are kept in size classes,
+// four per power of two, and handed out again instead of going back to the
+// system allocator. The cache is bounded by `limit` and trim() empties it in
+// one go. Blocks under `smallest` bytes bypass the pool.
+class BufferPool {
 private:
-  RGBPixel **pixels;
-
-public:
-  RGBImage() {
-    width = 0;
-    height = 0;
-    max_luminocity = 255;
-    pixels = nullptr;
+  static const size_t smallest = 64 * 1024;
+  static const size_t limit = 256 * 1024 * 1024;
+  std::mutex mutex;
+  std::map<size_t, std::vector<void *>> blocks;
+  size_t cached = 0;
+
+  static size_t sizeClass(size_t bytes) {
+    if (bytes < smallest) {
+      return bytes;
+    }
+    int top = 0;
+    while ((bytes >> top) > 1) {
+      top++;
+    }
+    size_t step = size_t(1) << (top - 2);
+    return (bytes + step - 1) & ~(step - 1);
   }
 
-  RGBImage(const RGBImage &img) {
-    width = img.width;
-    height = img.height;
-    max_luminocity = img.max_luminocity;
-    pixels = new RGBPixel *[height];
-    for (int i = 0; i < height; i++) {
-      pixels[i] = new RGBPixel[width];
-      for (int j = 0; j < width; j++) {
-        pixels[i][j] = img.pixels[i][j];
+public:
+  void *acquire(size_t bytes) {
+    size_t size = sizeClass(bytes);
+    if (size >= smallest) {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::vector<void *> &free = blocks[size];
+      if (!free.empty()) {
+        void *block = free.back();
+        free.pop_back();
+        cached -= size;
+#if defined(__SANITIZE_ADDRESS__)
+        ASAN_UNPOISON_MEMORY_REGION(block, size);
+#endif
+        return block;
       }
     }
+    return ::operator new(size);
   }
 
-  RGBImage(std::istream &stream) {
-    stream.seekg(0);
-
-    std::string magicNumber;
-    stream >> magicNumber;
-    if (magicNumber != "P3") {
+  void release(void *block, size_t bytes) {
+    if (block == nullptr) {
       return;
     }
-
-    stream >> width >> height >> max_luminocity;
-    pixels = new RGBPixel *[height];
-    for (int i = 0; i < height; i++) {
-      pixels[i] = new RGBPixel[width];
-      for (int j = 0; j < width; j++) {
-        int red, green, blue;
-        stream >> red >> green >> blue;
-        pixels[i][j] = RGBPixel(red, green, blue);
+    size_t size = sizeClass(bytes);
+    if (size >= smallest) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (cached + size <= limit) {
+        // Poisoned while cached, so stale pointers still trip the sanitizer
+#if defined(__SANITIZE_ADDRESS__)
+        ASAN_POISON_MEMORY_REGION(block, size);
+#endif
+        blocks[size].push_back(block);
+        cached += size;
+        return;
       }
     }
+    ::operator delete(block);
   }
 
-  ~RGBImage() {
-    for (int i = 0; i < height; i++) {
-        delete[] pixels[i];
+  void trim() {
+    std::map<size_t, std::vector<void *>> released;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      released.swap(blocks);
+      cached = 0;
     }
-    delete[] pixels;
+    for (auto &entry : released) {
+      for (void *block : entry.second) {
+#if defined(__SANITIZE_ADDRESS__)
+        ASAN_UNPOISON_MEMORY_REGION(block, entry.first);
+#endif
+        ::operator delete(block);
+      }
+    }
+  }
+};
+
+// Never destroyed, so images released during exit can still return blocks.
+BufferPool &bufferPool() {
+  static BufferPool *pool = new BufferPool;
+  return *pool;
 }
 
-  RGBImage(const YUVImage &yuvImage);
-  RGBImage(const GSCImage &yuvImage);
+template <typename T> struct PoolAllocator {
+  typedef T value_type;
 
-  RGBImage &operator=(const RGBImage &img) {
-    if (this == &img) {
-      return *this;
-    }
+  PoolAllocator() = default;
+  template <typename U> PoolAllocator(const PoolAllocator<U> &) {}
 
-    for (int i = 0; i < height; i++) {
-      delete[] pixels[i];
-    }
-    delete[] pixels;
+  T *allocate(size_t n) {
+    return static_cast<T *>(bufferPool().acquire(n * sizeof(T)));
+  }
+  void deallocate(T *p, size_t n) { bufferPool().release(p, n * sizeof(T)); }
 
-    width = img.width;
-    height = img.height;
-    max_luminocity = img.max_luminocity;
-    pixels = new RGBPixel *[height];
-    for (int i = 0; i < height; i++) {
-      pixels[i] = new RGBPixel[width];
-      for (int j = 0; j < width; j++) {
-        pixels[i][j] = img.pixels[i][j];
-      }
-    }
+  bool operator==(const PoolAllocator &) const { return true; }
+  bool operator!=(const PoolAllocator &) const { return false; }
+};
 
-    return *this;
+// Pixel rows of the RGB and grayscale images, all in one pooled block: its
+// size, the row pointers, then the rows back to back. Pixels are
+// default-initialized, as new P[] would leave them.
+const size_t pixelBlockHeader = alignof(std::max_align_t);
+
+template <typename P> P **allocatePixels(int width, int height) {
+  size_t table = (static_cast<size_t>(height) * sizeof(P *) + alignof(P) - 1) /
+                 alignof(P) * alignof(P);
+  size_t count = static_cast<size_t>(width) * height;
+  size_t bytes = pixelBlockHeader + table + count * sizeof(P);
+  char *block = static_cast<char *>(bufferPool().acquire(bytes));
+  std::memcpy(block, &bytes, sizeof(bytes));
+  P **rows = reinterpret_cast<P **>(block + pixelBlockHeader);
+  P *first = reinterpret_cast<P *>(block + pixelBlockHeader + table);
+  std::uninitialized_default_construct_n(first, count);
+  for (int i = 0; i < height; i++) {
+    rows[i] = first + static_cast<size_t>(i) * width;
   }
+  return rows;
+}
 
-  virtual Image &operator+=(int times) override {
-    if (times > 0) {
-	 times %= 4;
-      for (int t = 0; t < times; t++) {
-        RGBPixel **rotatedPixels = new RGBPixel *[width];
-        for (int i = 0; i < width; i++) {
-          rotatedPixels[i] = new RGBPixel[height];
-          for (int j = 0; j < height; j++) {
-            rotatedPixels[i][j] = pixels[height - j - 1][i];
-          }
-        }
+// The pixel classes only hold samples, so their storage is reused without
+// running destructors.
+template <typename P> void releasePixels(P **rows) {
+  if (rows == nullptr) {
+    return;
+  }
+  char *block = reinterpret_cast<char *>(rows) - pixelBlockHeader;
+  size_t bytes;
+  std::memcpy(&bytes, block, sizeof(bytes));
+  bufferPool().release(block, bytes);
+}
 
-        std::swap(width, height);
-        for (int i = 0; i < width; i++) {
-          delete[] pixels[i];
-        }
-        delete[] pixels;
-        pixels = rotatedPixels;
-      }
-    } else if (times < 0) {
-      times = std::abs(times);
-    times %= 4;
-      for (int t = 0; t < times; t++) {
-        RGBPixel **rotatedPixels = new RGBPixel *[width];
-        for (int i = 0; i < width; i++) {
-          rotatedPixels[i] = new RGBPixel[height];
-          for (int j = 0; j < height; j++) {
-            rotatedPixels[i][j] = pixels[j][width - i - 1];
-          }
-        }
+// A single channel stored row-major and contiguous, so kernels can walk rows
+// with plain pointers (and SIMD) instead of going through Pixel objects.
+// Plane holds 8-bit samples; WidePlane holds the samples of images whose
+// maxval is above 255.
+template <typename T> class BasicPlane {
+private:
+  int width;
+  int height;
+  std::vector<T, PoolAllocator<T>> data;
 
-        std::swap(width, height);
-        for (int i = 0; i < width; i++) {
-          delete[] pixels[i];
-        }
-        delete[] pixels;
-        pixels = rotatedPixels;
+public:
+  BasicPlane(int width = 0, int height = 0, T fill = 0)
+      : width(width), height(height),
+        data(static_cast<size_t>(width) * height, fill) {}
+
+  int getWidth() const { return width; }
+  int getHeight() const { return height; }
+
+  T *row(int i) { return &data[static_cast<size_t>(i) * width]; }
+  const T *row(int i) const { return &data[static_cast<size_t>(i) * width]; }
+};
+
+typedef BasicPlane<unsigned char> Plane;
+typedef BasicPlane<uint16_t> WidePlane;
+
+// Set on a thread while it runs a background job that `cancel` may
+// interrupt (see InterruptibleCommand); raised when the job is cancelled.
+thread_local const std::atomic<bool> *cancellation = nullptr;
+
+// Splits [begin, end) into one contiguous band per hardware thread and runs
+// body(first, last) on each. Bands never overlap, so row kernels that only
+// write their own rows need no locking. Inside an interruptible job the
+// range is cut into many small bands that the threads take in turn, and
+// none is started once the job is cancelled. Those bands are at least
+// `minBand` long (but never longer than the normal split), for kernels that
+// pay a setup cost per band.
+template <typename Body>
+void parallelFor(int begin, int end, Body body, int minBand = 1) {
+  int count = end - begin;
+  if (count <= 0) {
+    return;
+  }
+
+  int workers = static_cast<int>(std::thread::hardware_concurrency());
+  workers = std::max(1, std::min(workers, count));
+  const std::atomic<bool> *cancelled = cancellation;
+  if (cancelled) {
+    int band = std::max(1, count / (workers * 16));
+    band = std::min(std::max(band, minBand), (count + workers - 1) / workers);
+    std::atomic<int> next(begin);
+    auto work = [&next, cancelled, band, end](Body body) {
+      int first;
+      while (!*cancelled && (first = next.fetch_add(band)) < end) {
+        body(first, std::min(end, first + band));
       }
+    };
+    std::vector<std::thread> threads;
+    for (int w = 1; w < workers; w++) {
+      threads.emplace_back(work, body);
+    }
+    work(body);
+    for (std::thread &thread : threads) {
+      thread.join();
     }
+    return;
+  }
+  if (workers == 1) {
+    body(begin, end);
+    return;
+  }
 
-    return *this;
+  int band = (count + workers - 1) / workers;
+  std::vector<std::thread> threads;
+  for (int first = begin; first < end; first += band) {
+    threads.emplace_back(body, first, std::min(end, first + band));
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
   }
+}
 
-  virtual Image &operator*=(double factor) override {
-    int newWidth = static_cast<int>(width * factor);
-    int newHeight = static_cast<int>(height * factor);
+// Smallest band worth giving a kernel that must read `overlap` rows (or
+// columns) beyond its band before the first output: a band four times as
+// long keeps that warm-up under a fifth of its work.
+inline int bandWithOverlap(int overlap) {
+  return std::max(1, std::min(overlap, std::numeric_limits<int>::max() / 4) * 4);
+}
+
+// Raised on a thread once a kernel of its job has dropped a result because
+// the job was cancelled (see commitResult()).
+thread_local bool resultDropped = false;
+
+// Asked by a kernel before it puts a result built with parallelFor() into
+// an image. Once the running job is cancelled the result may be missing
+// bands, so it is dropped and the image keeps its pixels. Every later kernel
+// of the same command drops its result too, so an interrupted command
+// changes nothing.
+bool commitResult() {
+  if (cancellation && (resultDropped || *cancellation)) {
+    resultDropped = true;
+    return false;
+  }
+  return true;
+}
 
-    RGBPixel **resizedPixels = new RGBPixel *[newHeight];
-    for (int i = 0; i < newHeight; i++) {
-      resizedPixels[i] = new RGBPixel[newWidth];
-      for (int j = 0; j < newWidth; j++) {
-        int r1 = std::min(static_cast<int>(std::floor(i / factor)), height - 1);
-        int r2 = std::min(static_cast<int>(std::ceil(i / factor)), height - 1);
-        int c1 = std::min(static_cast<int>(std::floor(j / factor)), width - 1);
-        int c2 = std::min(static_cast<int>(std::ceil(j / factor)), width - 1);
+// parallelFor(0, height, body) for an in-place pass that undoes itself when
+// run twice (negation, mirroring). If the result is dropped, the rows that
+// were done are done again, which leaves the image as it was, and false is
+// returned.
+template <typename Body> bool parallelInvolution(int height, Body body) {
+  std::vector<char> done(height, 0);
+  parallelFor(0, height, [&](int first, int last) {
+    body(first, last);
+    std::fill(done.begin() + first, done.begin() + last, 1);
+  });
+  if (commitResult()) {
+    return true;
+  }
+  for (int i = 0; i < height; i++) {
+    if (done[i]) {
+      body(i, i + 1);
+    }
+  }
+  return false;
+}
 
-        int redSum = pixels[r1][c1].getRed() + pixels[r1][c2].getRed() +
-                     pixels[r2][c1].getRed() + pixels[r2][c2].getRed();
-        int greenSum = pixels[r1][c1].getGreen() + pixels[r1][c2].getGreen() +
-                       pixels[r2][c1].getGreen() + pixels[r2][c2].getGreen();
-        int blueSum = pixels[r1][c1].getBlue() + pixels[r1][c2].getBlue() +
-                      pixels[r2][c1].getBlue() + pixels[r2][c2].getBlue();
+// Holds off cancellation for the rest of a scope, for the conversions that
+// consume the image they convert and so cannot leave it as it was.
+class CancellationPause {
+private:
+  const std::atomic<bool> *paused;
 
-        int newRed = static_cast<int>(redSum / 4);
-        int newGreen = static_cast<int>(greenSum / 4);
-        int newBlue = static_cast<int>(blueSum / 4);
+public:
+  CancellationPause() : paused(cancellation) { cancellation = nullptr; }
+  ~CancellationPause() { cancellation = paused; }
+};
 
-        resizedPixels[i][j] = RGBPixel(newRed, newGreen, newBlue);
+// Side of the square tiles that rotating and warping kernels walk their
+// output in. Writing a tile reads a column segment from each of at most 64
+// source rows, few enough that their cache lines survive until the next
+// output row uses them.
+const int tileSize = 64;
+
+// Runs body(x, y, w, h) on every tile of a width×height grid. Tiles are the
+// scheduling unit: the threads take rows of tiles through parallelFor, so a
+// band never splits a tile and cancellation stops between tile rows.
+template <typename Body> void forEachTile(int width, int height, Body body) {
+  int tilesX = (width + tileSize - 1) / tileSize;
+  int tilesY = (height + tileSize - 1) / tileSize;
+  parallelFor(0, tilesY, [&](int first, int last) {
+    for (int ty = first; ty < last; ty++) {
+      int y = ty * tileSize;
+      for (int tx = 0; tx < tilesX; tx++) {
+        int x = tx * tileSize;
+        body(x, y, std::min(tileSize, width - x), std::min(tileSize, height - y));
       }
     }
+  });
+}
 
-    for (int i = 0; i < height; i++) {
-      delete[] pixels[i];
-    }
-    delete[] pixels;
+// Source pixel (row, col) that lands on (i, j) when a width×height image is
+// turned clockwise by `turns` quarter turns, 1 to 3, and how far the source
+// moves per step of j.
+inline void rotatedSource(int i, int j, int width, int height, int turns,
+                          int &row, int &col, int &rowStep, int &colStep) {
+  if (turns == 1) {
+    row = height - j - 1;
+    col = i;
+    rowStep = -1;
+    colStep = 0;
+  } else if (turns == 2) {
+    row = height - i - 1;
+    col = width - j - 1;
+    rowStep = 0;
+    colStep = -1;
+  } else {
+    row = j;
+    col = width - i - 1;
+    rowStep = 1;
+    colStep = 0;
+  }
+}
 
-    width = newWidth;
-    height = newHeight;
-    pixels = resizedPixels;
+enum class Interpolation { Bilinear, Bicubic };
 
-    return *this;
-  }
+// Forward 2x2 matrix [a b; c d] applied to (x, y) in image coordinates, where
+// y grows downwards. Positive rotation angles turn the image clockwise, the
+// same direction as the `r` command.
+struct AffineTransform {
+  double a, b, c, d;
 
-  virtual Image &operator!() override {
-    for (int i = 0; i < height; i++) {
-      for (int j = 0; j < width; j++) {
-        pixels[i][j].setRed(max_luminocity - pixels[i][j].getRed());
-        pixels[i][j].setGreen(max_luminocity - pixels[i][j].getGreen());
-        pixels[i][j].setBlue(max_luminocity - pixels[i][j].getBlue());
-      }
-    }
-    return *this;
+  static AffineTransform rotation(double degrees) {
+    double radians = degrees * M_PI / 180.0;
+    double cosine = std::cos(radians);
+    double sine = std::sin(radians);
+    return {cosine, -sine, sine, cosine};
   }
 
-  virtual Image &operator~() override {
-	  return *this;
+  static AffineTransform shear(double shearX, double shearY) {
+    return {1.0, shearX, shearY, 1.0};
   }
 
-  virtual Image &operator*() override {
-    for (int i = 0; i < getHeight(); i++) {
-      for (int j = 0; j < getWidth() / 2; j++) {
-       std::swap(pixels[i][j], pixels[i][width - j - 1]);
-      }
-    }
+  double determinant() const { return a * d - b * c; }
 
-    return *this;
+  bool isFinite() const {
+    return std::isfinite(a) && std::isfinite(b) && std::isfinite(c) &&
+           std::isfinite(d);
   }
+};
 
-  virtual Pixel &getPixel(int row, int col) const override {
-    return pixels[row][col];
-  }
+// Output size and inverse mapping of a warp. The output canvas is the
+// bounding box of the transformed source corners, so nothing is clipped.
+struct WarpGeometry {
+  int width;
+  int height;
+  double ia, ib, ic, id;
+  double originX, originY;
 };
 
-class YUVImage : public Image {
-private:
-  YUVPixel **pixels;
-  int max_luminocity = 235;
+// Bounding box of the transformed corners of a width×height source, with
+// its sides rounded up to whole pixels. Kept in doubles so that a canvas too
+// large for int can be refused (see warpFits()) before it is converted.
+struct WarpBounds {
+  double minX, minY;
+  double width, height;
+};
 
-public:
-  YUVImage() {
-    width = 0;
-    height = 0;
-    max_luminocity = 235;
-    pixels = nullptr;
+WarpBounds warpBounds(int width, int height, const AffineTransform &t) {
+  double xs[4] = {0.0, static_cast<double>(width), 0.0,
+                  static_cast<double>(width)};
+  double ys[4] = {0.0, 0.0, static_cast<double>(height),
+                  static_cast<double>(height)};
+  double minX = 0, maxX = 0, minY = 0, maxY = 0;
+  for (int k = 0; k < 4; k++) {
+    double x = t.a * xs[k] + t.b * ys[k];
+    double y = t.c * xs[k] + t.d * ys[k];
+    if (k == 0 || x < minX) minX = x;
+    if (k == 0 || x > maxX) maxX = x;
+    if (k == 0 || y < minY) minY = y;
+    if (k == 0 || y > maxY) maxY = y;
   }
+  return {minX, minY, std::max(1.0, std::ceil(maxX - minX - 1e-6)),
+          std::max(1.0, std::ceil(maxY - minY - 1e-6))};
+}
 
-  YUVImage(const YUVImage &img) {
-    width = img.width;
-    height = img.height;
-    max_luminocity = img.max_luminocity;
+// Whether the canvas of the warp stays within 16 times the source's area
+// (at least 4096×4096 pixels), so a mistyped coefficient is refused instead
+// of exhausting memory. That also keeps both sides within int.
+bool warpFits(int width, int height, const AffineTransform &t) {
+  WarpBounds bounds = warpBounds(width, height, t);
+  double limit = std::min(16.0 * std::max(static_cast<double>(width) * height,
+                                          1024.0 * 1024.0),
+                          static_cast<double>(std::numeric_limits<int>::max()));
+  return bounds.width * bounds.height <= limit;
+}
 
-    pixels = new YUVPixel *[height];
-    for (int i = 0; i < height; i++) {
-      pixels[i] = new YUVPixel[width];
-      for (int j = 0; j < width; j++) {
-        pixels[i][j] = img.pixels[i][j];
+// `t` must be finite and invertible, and warpFits() true.
+WarpGeometry planWarp(int width, int height, const AffineTransform &t) {
+  WarpBounds bounds = warpBounds(width, height, t);
+  WarpGeometry g;
+  g.width = static_cast<int>(bounds.width);
+  g.height = static_cast<int>(bounds.height);
+  double det = t.determinant();
+  g.ia = t.d / det;
+  g.ib = -t.b / det;
+  g.ic = -t.c / det;
+  g.id = t.a / det;
+  g.originX = bounds.minX;
+  g.originY = bounds.minY;
+  return g;
+}
+
+// The same warp seen from a plane subsampled by (factorX, factorY), such as
+// the chroma of 4:2:0 YUV: sample centres sit at the middle of each block.
+WarpGeometry subsampleWarp(const WarpGeometry &g, int factorX, int factorY) {
+  WarpGeometry sub = g;
+  sub.width = (g.width + factorX - 1) / factorX;
+  sub.height = (g.height + factorY - 1) / factorY;
+  sub.ib = g.ib * factorY / factorX;
+  sub.ic = g.ic * factorX / factorY;
+  sub.originX = g.originX / factorX;
+  sub.originY = g.originY / factorY;
+  return sub;
+}
+
+// Blends four neighbour rows with 8-bit bilinear weights. Every product fits
+// in an unsigned 16-bit lane, so the SSE2 path gives bit-identical results to
+// the scalar tail.
+void blendBilinearRow(const uint16_t *p00, const uint16_t *p01,
+                      const uint16_t *p10, const uint16_t *p11,
+                      const uint16_t *wx, const uint16_t *wy,
+                      unsigned char *out, int count) {
+  int j = 0;
+#if defined(__SSE2__)
+  const __m128i full = _mm_set1_epi16(256);
+  const __m128i half = _mm_set1_epi16(128);
+  for (; j + 8 <= count; j += 8) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(wx + j));
+    __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(wy + j));
+    __m128i ix = _mm_sub_epi16(full, x);
+    __m128i iy = _mm_sub_epi16(full, y);
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p00 + j));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p01 + j));
+    __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p10 + j));
+    __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p11 + j));
+    __m128i top = _mm_srli_epi16(
+        _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(a, ix),
+                                    _mm_mullo_epi16(b, x)),
+                      half),
+        8);
+    __m128i bottom = _mm_srli_epi16(
+        _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(c, ix),
+                                    _mm_mullo_epi16(d, x)),
+                      half),
+        8);
+    __m128i value = _mm_srli_epi16(
+        _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(top, iy),
+                                    _mm_mullo_epi16(bottom, y)),
+                      half),
+        8);
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(out + j),
+                     _mm_packus_epi16(value, value));
+  }
+#endif
+  for (; j < count; j++) {
+    int top = (p00[j] * (256 - wx[j]) + p01[j] * wx[j] + 128) >> 8;
+    int bottom = (p10[j] * (256 - wx[j]) + p11[j] * wx[j] + 128) >> 8;
+    out[j] = static_cast<unsigned char>(
+        (top * (256 - wy[j]) + bottom * wy[j] + 128) >> 8);
+  }
+}
+
+// The same blend for 16-bit samples, whose products need 32-bit lanes.
+void blendBilinearRow(const uint16_t *p00, const uint16_t *p01,
+                      const uint16_t *p10, const uint16_t *p11,
+                      const uint16_t *wx, const uint16_t *wy, uint16_t *out,
+                      int count) {
+  for (int j = 0; j < count; j++) {
+    uint32_t top = (p00[j] * (256u - wx[j]) + p01[j] * wx[j] + 128) >> 8;
+    uint32_t bottom = (p10[j] * (256u - wx[j]) + p11[j] * wx[j] + 128) >> 8;
+    out[j] = static_cast<uint16_t>((top * (256u - wy[j]) + bottom * wy[j] + 128) >> 8);
+  }
+}
+
+// Catmull-Rom weights for 256 sub-pixel phases, scaled to sum to exactly 2048.
+struct BicubicTable {
+  int weights[256 * 4];
+
+  BicubicTable() {
+    for (int phase = 0; phase < 256; phase++) {
+      double t = phase / 256.0;
+      double w[4] = {((-0.5 * t + 1.0) * t - 0.5) * t,
+                     (1.5 * t - 2.5) * t * t + 1.0,
+                     ((-1.5 * t + 2.0) * t + 0.5) * t,
+                     (0.5 * t - 0.5) * t * t};
+      int sum = 0;
+      for (int k = 0; k < 4; k++) {
+        weights[phase * 4 + k] = static_cast<int>(std::lround(w[k] * 2048));
+        sum += weights[phase * 4 + k];
       }
+      weights[phase * 4 + (phase < 128 ? 1 : 2)] += 2048 - sum;
     }
   }
+};
 
-  YUVImage(const RGBImage &rgbImage) {
-    width = rgbImage.getWidth();
-    height = rgbImage.getHeight();
+const int *bicubicWeights() {
+  static const BicubicTable table;
+  return table.weights;
+}
 
-    pixels = new YUVPixel *[height];
-    for (int i = 0; i < height; i++) {
-      pixels[i] = new YUVPixel[width];
-      for (int j = 0; j < width; j++) {
-        const Pixel &pixel = rgbImage.getPixel(i, j);
-        const RGBPixel &rgbPixel = dynamic_cast<const RGBPixel &>(pixel);
+// Resamples one channel through the inverse mapping in `g`. Source positions
+// are stepped along each output row in 16.16 fixed point, so the per-pixel
+// cost is two additions plus the interpolation itself. Bicubic overshoot is
+// clamped to [0, maxValue]. The output is produced tile by tile, so a
+// rotation reads a compact patch of source rows instead of a diagonal
+// through the whole image.
+template <typename T>
+BasicPlane<T> warpPlane(const BasicPlane<T> &src, const WarpGeometry &g,
+                        Interpolation interpolation, T fill, int maxValue) {
+  BasicPlane<T> dst(g.width, g.height);
+  const int w = src.getWidth();
+  const int h = src.getHeight();
+  const double one = 65536.0;
+  const int64_t stepX = std::llround(g.ia * one);
+  const int64_t stepY = std::llround(g.ic * one);
+  const int64_t lowX = -32768, highX = (static_cast<int64_t>(w) << 16) - 32768;
+  const int64_t lowY = -32768, highY = (static_cast<int64_t>(h) << 16) - 32768;
+  const int *cubic = bicubicWeights();
+
+  forEachTile(g.width, g.height, [&](int x, int y, int tw, int th) {
+    uint16_t p00[tileSize], p01[tileSize], p10[tileSize], p11[tileSize],
+        wx[tileSize], wy[tileSize];
+
+    for (int i = y; i < y + th; i++) {
+      double u = g.originX + 0.5;
+      double v = g.originY + i + 0.5;
+      int64_t sx = std::llround((g.ia * u + g.ib * v - 0.5) * one) + x * stepX;
+      int64_t sy = std::llround((g.ic * u + g.id * v - 0.5) * one) + x * stepY;
+      T *out = dst.row(i) + x;
+
+      for (int j = 0; j < tw; j++, sx += stepX, sy += stepY) {
+        bool inside = sx >= lowX && sx <= highX && sy >= lowY && sy <= highY;
+        int ix = static_cast<int>(sx >> 16);
+        int iy = static_cast<int>(sy >> 16);
+        int fx = static_cast<int>((sx >> 8) & 0xFF);
+        int fy = static_cast<int>((sy >> 8) & 0xFF);
+
+        if (interpolation == Interpolation::Bicubic) {
+          if (!inside) {
+            out[j] = fill;
+            continue;
+          }
+          int64_t acc = 0;
+          for (int m = 0; m < 4; m++) {
+            const T *r = src.row(std::min(std::max(iy - 1 + m, 0), h - 1));
+            int across = 0;
+            for (int k = 0; k < 4; k++) {
+              across += cubic[fx * 4 + k] *
+                        r[std::min(std::max(ix - 1 + k, 0), w - 1)];
+            }
+            acc += static_cast<int64_t>(cubic[fy * 4 + m]) * across;
+          }
+          int value = static_cast<int>((acc + (1 << 21)) >> 22);
+          out[j] = static_cast<T>(std::min(std::max(value, 0), maxValue));
+          continue;
+        }
+
+        if (!inside) {
+          p00[j] = p01[j] = p10[j] = p11[j] = fill;
+          wx[j] = wy[j] = 0;
+          continue;
+        }
+        int x0 = std::min(std::max(ix, 0), w - 1);
+        int x1 = std::min(std::max(ix + 1, 0), w - 1);
+        const T *r0 = src.row(std::min(std::max(iy, 0), h - 1));
+        const T *r1 = src.row(std::min(std::max(iy + 1, 0), h - 1));
+        p00[j] = r0[x0];
+        p01[j] = r0[x1];
+        p10[j] = r1[x0];
+        p11[j] = r1[x1];
+        wx[j] = static_cast<uint16_t>(fx);
+        wy[j] = static_cast<uint16_t>(fy);
+      }
 
-        int y1 = static_cast<int>(((66 * rgbPixel.getRed() + 129 * rgbPixel.getGreen() + 25 * rgbPixel.getBlue() + 128) >> 8) + 16);
-        int u1 = static_cast<int>(((-38 * rgbPixel.getRed() - 74 * rgbPixel.getGreen() + 112 * rgbPixel.getBlue() + 128) >> 8) + 128);
-        int v1 = static_cast<int>(((112 * rgbPixel.getRed() - 94 * rgbPixel.getGreen() - 18 * rgbPixel.getBlue() + 128) >> 8) + 128);
-		  
-        unsigned char y = static_cast<unsigned char>(y1);
-        unsigned char u = static_cast<unsigned char>(u1);
-        unsigned char v = static_cast<unsigned char>(v1);
-		  
-        pixels[i][j] = YUVPixel(y, u, v);
+      if (interpolation == Interpolation::Bilinear) {
+        blendBilinearRow(p00, p01, p10, p11, wx, wy, out, tw);
       }
     }
+  });
+
+  return dst;
+}
+
+enum class EdgeMode { Clamp, Mirror, Wrap, Zero };
+
+bool parseEdgeMode(const std::string &name, EdgeMode &mode) {
+  if (name == "clamp") {
+    mode = EdgeMode::Clamp;
+  } else if (name == "mirror") {
+    mode = EdgeMode::Mirror;
+  } else if (name == "wrap") {
+    mode = EdgeMode::Wrap;
+  } else if (name == "zero") {
+    mode = EdgeMode::Zero;
+  } else {
+    return false;
   }
+  return true;
+}
 
- ~YUVImage() {
-    for (int i = 0; i < height; i++) {
-        delete[] pixels[i];
+// Maps a possibly out-of-range index onto [0, n). Returns -1 when the index
+// is outside the image and the mode is Zero.
+int edgeIndex(int i, int n, EdgeMode mode) {
+  if (i >= 0 && i < n) {
+    return i;
+  }
+  switch (mode) {
+  case EdgeMode::Clamp:
+    return i < 0 ? 0 : n - 1;
+  case EdgeMode::Mirror: {
+    if (n == 1) {
+      return 0;
     }
-    delete[] pixels;
+    int period = 2 * n - 2;
+    i %= period;
+    if (i < 0) {
+      i += period;
+    }
+    return i < n ? i : period - i;
+  }
+  case EdgeMode::Wrap:
+    i %= n;
+    return i < 0 ? i + n : i;
+  default:
+    return -1;
+  }
 }
 
-  virtual Image &operator+=(int times) override {return *this;}
-  virtual Image &operator*=(double factor) override {return *this;}
-  virtual Image &operator!() override {return *this;}
-  virtual Image &operator~() override {
-    int histogram[236] = {0};
-    for (int i = 0; i < height; i++) {
-      for (int j = 0; j < width; j++) {
-        unsigned char luminance = pixels[i][j].getY();
-        histogram[luminance]++;
-      }
+// Copies `row` into `padded` with `radius` extra samples on each side.
+template <typename T>
+void padRow(const T *row, int width, int radius, EdgeMode mode, T *padded) {
+  for (int j = -radius; j < width + radius; j++) {
+    int source = edgeIndex(j, width, mode);
+    padded[j + radius] = source < 0 ? 0 : row[source];
+  }
+}
+
+// Largest sigma `blur` and `sharpen` accept. Its 6 * sigma + 1 taps still
+// get a centre weight of about 25 out of 1 << 14; much wider kernels would
+// round most of their weights to 0 and cost more per pixel than a whole row.
+const double maxGaussianSigma = 256.0;
+
+// Separable kernel with 14-bit fixed-point weights summing to 1 << 14. The
+// tap count is rounded up to an even number with a trailing zero weight so
+// the SIMD loops can always consume taps in pairs.
+struct SeparableKernel {
+  int radius;
+  std::vector<int16_t> weights;
+
+  static SeparableKernel gaussian(double sigma) {
+    SeparableKernel kernel;
+    kernel.radius = std::max(1, static_cast<int>(std::ceil(3.0 * sigma)));
+    std::vector<double> exact(2 * kernel.radius + 1);
+    double total = 0.0;
+    for (int k = -kernel.radius; k <= kernel.radius; k++) {
+      exact[k + kernel.radius] = std::exp(-(k * k) / (2.0 * sigma * sigma));
+      total += exact[k + kernel.radius];
     }
-    
-    // Calculate probability distribution
-    double probabilityDistribution[236];
-    for (int i = 0; i <= 235; i++) {
-      probabilityDistribution[i] = static_cast<double>(histogram[i]) / (width * height);
+    int sum = 0;
+    for (double w : exact) {
+      kernel.weights.push_back(
+          static_cast<int16_t>(std::lround(w / total * (1 << 14))));
+      sum += kernel.weights.back();
+    }
+    kernel.weights[kernel.radius] += (1 << 14) - sum;
+    if (kernel.weights.size() % 2) {
+      kernel.weights.push_back(0);
     }
+    return kernel;
+  }
+};
 
-    // Calculate cumulative probability distribution
-    double cumulativeDistribution[236];
-    cumulativeDistribution[0] = probabilityDistribution[0];
-    for (int i = 1; i <= 235; i++) {
-      cumulativeDistribution[i] = cumulativeDistribution[i - 1] + probabilityDistribution[i];
+// Horizontal pass: out[j] = sum(w[t] * padded[j + t]) with 7 fraction bits
+// kept, which leaves the result in int16 range for the vertical pass.
+void convolveRowHorizontal(const unsigned char *padded, const int16_t *weights,
+                           int taps, int16_t *out, int width) {
+  int j = 0;
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round = _mm_set1_epi32(1 << 6);
+  for (; j + 8 <= width; j += 8) {
+    __m128i low = _mm_setzero_si128();
+    __m128i high = _mm_setzero_si128();
+    for (int t = 0; t < taps; t += 2) {
+      __m128i a = _mm_unpacklo_epi8(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i *>(padded + j + t)),
+          zero);
+      __m128i b = _mm_unpacklo_epi8(
+          _mm_loadl_epi64(
+              reinterpret_cast<const __m128i *>(padded + j + t + 1)),
+          zero);
+      __m128i pair = _mm_set1_epi32((static_cast<int>(weights[t + 1]) << 16) |
+                                    static_cast<uint16_t>(weights[t]));
+      low = _mm_add_epi32(low, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), pair));
+      high = _mm_add_epi32(high, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), pair));
+    }
+    low = _mm_srai_epi32(_mm_add_epi32(low, round), 7);
+    high = _mm_srai_epi32(_mm_add_epi32(high, round), 7);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + j),
+                     _mm_packs_epi32(low, high));
+  }
+#endif
+  for (; j < width; j++) {
+    int acc = 0;
+    for (int t = 0; t < taps; t++) {
+      acc += weights[t] * padded[j + t];
     }
+    out[j] = static_cast<int16_t>((acc + (1 << 6)) >> 7);
+  }
+}
 
-    // Calculate new luminance values
-    int newLuminance[236];
-    for (int i = 0; i <= 235; i++) {
-      newLuminance[i] = static_cast<int>(cumulativeDistribution[i] * 235);
+// Vertical pass over `taps` horizontally filtered rows, producing 8-bit
+// output. rows[t] must be valid for every t < taps, zero-weight ones included.
+void convolveRowVertical(const int16_t *const *rows, const int16_t *weights,
+                         int taps, unsigned char *out, int width) {
+  int j = 0;
+#if defined(__SSE2__)
+  const __m128i round = _mm_set1_epi32(1 << 20);
+  for (; j + 8 <= width; j += 8) {
+    __m128i low = _mm_setzero_si128();
+    __m128i high = _mm_setzero_si128();
+    for (int t = 0; t < taps; t += 2) {
+      __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[t] + j));
+      __m128i b =
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[t + 1] + j));
+      __m128i pair = _mm_set1_epi32((static_cast<int>(weights[t + 1]) << 16) |
+                                    static_cast<uint16_t>(weights[t]));
+      low = _mm_add_epi32(low, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), pair));
+      high = _mm_add_epi32(high, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), pair));
     }
+    low = _mm_srai_epi32(_mm_add_epi32(low, round), 21);
+    high = _mm_srai_epi32(_mm_add_epi32(high, round), 21);
+    __m128i words = _mm_packs_epi32(low, high);
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(out + j),
+                     _mm_packus_epi16(words, words));
+  }
+#endif
+  for (; j < width; j++) {
+    int acc = 0;
+    for (int t = 0; t < taps; t++) {
+      acc += weights[t] * rows[t][j];
+    }
+    acc = (acc + (1 << 20)) >> 21;
+    out[j] = static_cast<unsigned char>(std::min(std::max(acc, 0), 255));
+  }
+}
 
-    // Apply luminance transformation to the image
-    for (int i = 0; i < height; i++) {
-      for (int j = 0; j < width; j++) {
-        unsigned char currentLuminance = pixels[i][j].getY();
-        int newPixelValue1 = static_cast<int>(newLuminance[currentLuminance]);
-		unsigned char newPixelValue = static_cast<unsigned char>(newPixelValue1);
-		pixels[i][j].setY(newPixelValue);
-      }
+// 16-bit counterparts of the two passes. The horizontal sums keep all 14
+// fraction bits in 32 bits and the vertical pass accumulates in 64 bits;
+// they run scalar, the 8-bit passes above keep the SIMD path.
+void convolveRowHorizontal(const uint16_t *padded, const int16_t *weights,
+                           int taps, int32_t *out, int width) {
+  for (int j = 0; j < width; j++) {
+    int32_t acc = 0;
+    for (int t = 0; t < taps; t++) {
+      acc += weights[t] * padded[j + t];
     }
-    
-    
-    return *this;
+    out[j] = acc;
   }
+}
 
-  virtual Image &operator*() override {return *this;}
-  virtual Pixel &getPixel(int row, int col) const override {
-    return pixels[row][col];
+void convolveRowVertical(const int32_t *const *rows, const int16_t *weights,
+                         int taps, uint16_t *out, int width) {
+  for (int j = 0; j < width; j++) {
+    int64_t acc = 0;
+    for (int t = 0; t < taps; t++) {
+      acc += static_cast<int64_t>(weights[t]) * rows[t][j];
+    }
+    acc = (acc + (int64_t(1) << 27)) >> 28;
+    out[j] = static_cast<uint16_t>(std::min<int64_t>(std::max<int64_t>(acc, 0), 65535));
   }
-};
+}
 
-RGBImage::RGBImage(const YUVImage &yuvImage) {
-  width = yuvImage.getWidth();
-  height = yuvImage.getHeight();
+// Two-pass separable convolution. Each row band keeps a ring of the last
+// 2 * radius + 1 horizontally filtered rows, so every source row goes through
+// the horizontal pass once per band and no full-size intermediate exists.
+template <typename T>
+BasicPlane<T> convolveSeparable(const BasicPlane<T> &src,
+                                const SeparableKernel &kernel, EdgeMode edge) {
+  typedef typename std::conditional<sizeof(T) == 1, int16_t, int32_t>::type
+      Filtered;
+  const int width = src.getWidth();
+  const int height = src.getHeight();
+  const int radius = kernel.radius;
+  const int window = 2 * radius + 1;
+  const int taps = static_cast<int>(kernel.weights.size());
+  BasicPlane<T> dst(width, height);
+
+  parallelFor(0, height, [&](int first, int last) {
+    std::vector<T> padded(width + taps + 8);
+    std::vector<std::vector<Filtered>> ring(window,
+                                            std::vector<Filtered>(width + 8));
+    std::vector<const Filtered *> rows(taps);
+
+    auto filterRow = [&](int k) {
+      std::vector<Filtered> &slot = ring[((k % window) + window) % window];
+      int source = edgeIndex(k, height, edge);
+      if (source < 0) {
+        std::fill(slot.begin(), slot.end(), 0);
+        return;
+      }
+      padRow(src.row(source), width, radius, edge, padded.data());
+      convolveRowHorizontal(padded.data(), kernel.weights.data(), taps,
+                            slot.data(), width);
+    };
 
-  pixels = new RGBPixel *[height];
-  for (int i = 0; i < height; i++) {
-    pixels[i] = new RGBPixel[width];
-    for (int j = 0; j < width; j++) {
-      const Pixel &pixel = yuvImage.getPixel(i, j);
-      const YUVPixel &yuvPixel = dynamic_cast<const YUVPixel &>(pixel);
+    for (int k = first - radius; k < first + radius; k++) {
+      filterRow(k);
+    }
+    for (int i = first; i < last; i++) {
+      filterRow(i + radius);
+      for (int t = 0; t < taps; t++) {
+        int k = i - radius + std::min(t, window - 1);
+        rows[t] = ring[((k % window) + window) % window].data();
+      }
+      convolveRowVertical(rows.data(), kernel.weights.data(), taps,
+                          dst.row(i), width);
+    }
+  }, bandWithOverlap(2 * radius));
 
-      int y = static_cast<int>(yuvPixel.getY());
-      int u = static_cast<int>(yuvPixel.getU());
-      int v = static_cast<int>(yuvPixel.getV());
-
-      int red1 = ((298 * (y - 16) + 409 * (v - 128) + 128) >> 8);
-      int green1 = ((298 * (y - 16) - 100 * (u - 128) - 208 * (v - 128) + 128) >> 8);
-      int blue1 = ((298 * (y - 16) + 516 * (u - 128) + 128) >> 8);
-      
-      if (red1 < 0) {
-        red1 = 0;
-	  }
-      else if (red1 > 255) {
-        red1 = 255;
-	  }
+  return dst;
+}
 
-      if (green1 < 0) {
-        green1 = 0;
-	  }
-      else if (green1 > 255) {
-        green1 = 255;
-	  }
+// Box blur with running sums in both directions, so the cost per pixel does
+// not depend on the radius. Each band keeps one row of column sums: a row
+// entering the window adds its horizontal sums, and the row leaving it is
+// summed again from the source and subtracted, so memory stays O(width).
+// The radius is capped at the larger side of the plane.
+template <typename T>
+BasicPlane<T> boxBlurPlane(const BasicPlane<T> &src, int radius, EdgeMode edge) {
+  typedef uint64_t Sum;
+  const int width = src.getWidth();
+  const int height = src.getHeight();
+  radius = std::min(radius, std::max(width, height));
+  const int window = 2 * radius + 1;
+  const Sum area = static_cast<Sum>(window) * window;
+  BasicPlane<T> dst(width, height);
+
+  parallelFor(0, height, [&](int first, int last) {
+    std::vector<T> padded(width + 2 * radius);
+    std::vector<Sum> columns(width, 0);
+
+    // Adds the horizontal sums of row k to the column sums, or subtracts
+    // them when `entering` is false.
+    auto slideRow = [&](int k, bool entering) {
+      int source = edgeIndex(k, height, edge);
+      if (source < 0) {
+        return;
+      }
+      padRow(src.row(source), width, radius, edge, padded.data());
+      Sum sum = 0;
+      for (int t = 0; t < window; t++) {
+        sum += padded[t];
+      }
+      for (int j = 0; j < width; j++) {
+        if (entering) {
+          columns[j] += sum;
+        } else {
+          columns[j] -= sum;
+        }
+        if (j + 1 < width) {
+          sum += padded[j + window];
+          sum -= padded[j];
+        }
+      }
+    };
 
-      if (blue1 < 0) {
-        blue1 = 0;
-	  }
-      else if (blue1 > 255) {
-        blue1 = 255;
-	  }
+    for (int k = first - radius; k < first + radius; k++) {
+      slideRow(k, true);
+    }
+    for (int i = first; i < last; i++) {
+      slideRow(i + radius, true);
+      T *out = dst.row(i);
+      for (int j = 0; j < width; j++) {
+        out[j] = static_cast<T>((columns[j] + area / 2) / area);
+      }
+      slideRow(i - radius, false);
+    }
+  }, bandWithOverlap(2 * radius));
 
-      unsigned char red = static_cast<unsigned char>(red1);
-      unsigned char green = static_cast<unsigned char>(green1);
-      unsigned char blue = static_cast<unsigned char>(blue1);
+  return dst;
+}
 
-      pixels[i][j] = RGBPixel(red, green, blue);
+// Unsharp mask: src + amount * (src - gaussian(src)), with the amount in
+// 8-bit fixed point and the result clamped to [0, maxValue].
+template <typename T>
+BasicPlane<T> unsharpMaskPlane(const BasicPlane<T> &src, double sigma,
+                               double amount, EdgeMode edge, int maxValue) {
+  BasicPlane<T> blurred =
+      convolveSeparable(src, SeparableKernel::gaussian(sigma), edge);
+  const int gain = static_cast<int>(std::lround(amount * 256));
+  parallelFor(0, src.getHeight(), [&](int first, int last) {
+    for (int i = first; i < last; i++) {
+      const T *original = src.row(i);
+      T *out = blurred.row(i);
+      for (int j = 0; j < src.getWidth(); j++) {
+        int64_t detail = original[j] - out[j];
+        int64_t value = original[j] + ((detail * gain + 128) >> 8);
+        out[j] = static_cast<T>(std::min<int64_t>(std::max<int64_t>(value, 0), maxValue));
+      }
     }
-  }
-
-  delete &yuvImage;
+  });
+  return blurred;
 }
 
-class GSCImage : public Image {
-private:
-  GSCPixel **pixels;
-  int max_luminocity = 255;
+// Rank filter over a (2 * radius + 1)^2 window, after Perreault and Hebert's
+// constant-time median. Every column keeps a 256-bin histogram of the rows
+// in the window, so moving down one row costs O(1) per column. The window
+// histogram slides right by adding one column and dropping another: its
+// 16-bin coarse level is updated on every step, while each fine bucket is
+// only brought up to date when the rank search actually enters it. The work
+// per pixel is therefore independent of the radius.
+//
+// `percentile` is 0 for min, 50 for median and 100 for max. Columns are split
+// into strips so every thread owns its own column histograms.
+Plane rankFilterPlane(const Plane &src, int radius, double percentile,
+                      EdgeMode edge) {
+  const int width = src.getWidth();
+  const int height = src.getHeight();
+  const int window = 2 * radius + 1;
+  const uint32_t area = static_cast<uint32_t>(window) * window;
+  const uint32_t rank =
+      static_cast<uint32_t>(std::floor(percentile / 100.0 * (area - 1) + 0.5));
+  const int stale = -1;
+  Plane dst(width, height);
+
+  parallelFor(0, width, [&](int first, int last) {
+    const int span = last - first + 2 * radius;
+    std::vector<uint32_t> fine(static_cast<size_t>(span) * 256, 0);
+    std::vector<uint32_t> coarse(static_cast<size_t>(span) * 16, 0);
+    std::vector<int> columns(span);
+    for (int k = 0; k < span; k++) {
+      columns[k] = edgeIndex(first - radius + k, width, edge);
+    }
 
-public:
-  GSCImage() {
-    width = 0;
-    height = 0;
-    max_luminocity = 255;
-    pixels = nullptr;
-  }
+    auto updateRow = [&](int row, uint32_t delta) {
+      int source = edgeIndex(row, height, edge);
+      const unsigned char *values = source < 0 ? nullptr : src.row(source);
+      for (int k = 0; k < span; k++) {
+        int value = values == nullptr || columns[k] < 0 ? 0 : values[columns[k]];
+        fine[static_cast<size_t>(k) * 256 + value] += delta;
+        coarse[static_cast<size_t>(k) * 16 + (value >> 4)] += delta;
+      }
+    };
+
+    uint32_t kernelCoarse[16];
+    uint32_t kernelFine[256];
+    int upToDate[16];
+
+    // Brings fine bucket `bucket` of the window histogram to the window
+    // centred on strip offset `at`.
+    auto refreshBucket = [&](int bucket, int at) {
+      uint32_t *counts = kernelFine + bucket * 16;
+      if (upToDate[bucket] != stale && at - upToDate[bucket] <= window) {
+        for (int p = upToDate[bucket] + 1; p <= at; p++) {
+          const uint32_t *added = &fine[static_cast<size_t>(p + 2 * radius) * 256 + bucket * 16];
+          const uint32_t *removed = &fine[static_cast<size_t>(p - 1) * 256 + bucket * 16];
+          for (int v = 0; v < 16; v++) {
+            counts[v] += added[v] - removed[v];
+          }
+        }
+      } else {
+        std::fill(counts, counts + 16, 0);
+        for (int k = at; k < at + window; k++) {
+          const uint32_t *column = &fine[static_cast<size_t>(k) * 256 + bucket * 16];
+          for (int v = 0; v < 16; v++) {
+            counts[v] += column[v];
+          }
+        }
+      }
+      upToDate[bucket] = at;
+    };
 
-  GSCImage(const GSCImage &img) {
-    width = img.width;
-    height = img.height;
-    max_luminocity = img.max_luminocity;
+    for (int row = -radius; row < radius; row++) {
+      updateRow(row, 1);
+    }
 
-    pixels = new GSCPixel *[height];
     for (int i = 0; i < height; i++) {
-      pixels[i] = new GSCPixel[width];
-      for (int j = 0; j < width; j++) {
-        pixels[i][j] = img.pixels[i][j];
+      updateRow(i + radius, 1);
+
+      std::fill(kernelCoarse, kernelCoarse + 16, 0);
+      std::fill(upToDate, upToDate + 16, stale);
+      for (int k = 0; k < window; k++) {
+        for (int b = 0; b < 16; b++) {
+          kernelCoarse[b] += coarse[static_cast<size_t>(k) * 16 + b];
+        }
+      }
+
+      unsigned char *out = dst.row(i);
+      for (int at = 0; at < last - first; at++) {
+        if (at > 0) {
+          const uint32_t *added = &coarse[static_cast<size_t>(at + 2 * radius) * 16];
+          const uint32_t *removed = &coarse[static_cast<size_t>(at - 1) * 16];
+          for (int b = 0; b < 16; b++) {
+            kernelCoarse[b] += added[b] - removed[b];
+          }
+        }
+
+        uint32_t seen = 0;
+        int bucket = 0;
+        while (seen + kernelCoarse[bucket] <= rank) {
+          seen += kernelCoarse[bucket];
+          bucket++;
+        }
+        refreshBucket(bucket, at);
+        int value = bucket * 16;
+        while (seen + kernelFine[value] <= rank) {
+          seen += kernelFine[value];
+          value++;
+        }
+        out[first + at] = static_cast<unsigned char>(value);
       }
+
+      updateRow(i - radius, static_cast<uint32_t>(-1));
     }
-  }
+  }, bandWithOverlap(2 * radius));
 
-  GSCImage(const RGBImage &grayscaled) {
-    width = grayscaled.getWidth();
-    height = grayscaled.getHeight();
-    max_luminocity = grayscaled.getMaxLuminocity();
+  return dst;
+}
 
-    pixels = new GSCPixel *[height];
-    for (int i = 0; i < height; i++) {
-      pixels[i] = new GSCPixel[width];
+// 16-bit rank filter. Per-column histograms of 65536 bins would not fit in
+// memory, so every row runs Huang's sliding window instead: a single window
+// histogram with 256 coarse and 65536 fine bins gains one column and loses
+// one per step. The cost per pixel grows linearly with the radius.
+WidePlane rankFilterPlane(const WidePlane &src, int radius, double percentile,
+                          EdgeMode edge) {
+  const int width = src.getWidth();
+  const int height = src.getHeight();
+  const int window = 2 * radius + 1;
+  const uint32_t area = static_cast<uint32_t>(window) * window;
+  const uint32_t rank =
+      static_cast<uint32_t>(std::floor(percentile / 100.0 * (area - 1) + 0.5));
+  WidePlane dst(width, height);
+
+  parallelFor(0, height, [&](int first, int last) {
+    std::vector<uint32_t> fine(65536, 0);
+    std::vector<uint32_t> coarse(256, 0);
+    std::vector<int> rows(window);
+
+    auto updateColumn = [&](int column, uint32_t delta) {
+      int source = edgeIndex(column, width, edge);
+      for (int row : rows) {
+        int value = source < 0 || row < 0 ? 0 : src.row(row)[source];
+        fine[value] += delta;
+        coarse[value >> 8] += delta;
+      }
+    };
+
+    for (int i = first; i < last; i++) {
+      for (int k = 0; k < window; k++) {
+        rows[k] = edgeIndex(i - radius + k, height, edge);
+      }
+      for (int column = -radius; column < radius; column++) {
+        updateColumn(column, 1);
+      }
+
+      uint16_t *out = dst.row(i);
       for (int j = 0; j < width; j++) {
-        const Pixel &pixel = grayscaled.getPixel(i, j);
-        const RGBPixel &rgbPixel = dynamic_cast<const RGBPixel &>(pixel);
-        unsigned char grayValue = static_cast<unsigned char>(rgbPixel.getRed() * 0.3 + rgbPixel.getGreen() * 0.59 + rgbPixel.getBlue() * 0.11);
-        pixels[i][j] = GSCPixel(grayValue);
+        updateColumn(j + radius, 1);
+        uint32_t seen = 0;
+        int bucket = 0;
+        while (seen + coarse[bucket] <= rank) {
+          seen += coarse[bucket];
+          bucket++;
+        }
+        int value = bucket << 8;
+        while (seen + fine[value] <= rank) {
+          seen += fine[value];
+          value++;
+        }
+        out[j] = static_cast<uint16_t>(value);
+        updateColumn(j - radius, static_cast<uint32_t>(-1));
+      }
+
+      // Leaves both histograms empty for the next row
+      for (int column = width - radius; column < width + radius; column++) {
+        updateColumn(column, static_cast<uint32_t>(-1));
       }
     }
+  });
+
+  return dst;
+}
+
+// out = min(a, b), or max(a, b) when `maximum` is set, sample by sample.
+void extremumRows(const unsigned char *a, const unsigned char *b,
+                  unsigned char *out, int width, bool maximum) {
+  int j = 0;
+#if defined(__SSE2__)
+  for (; j + 16 <= width; j += 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + j));
+    __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + j));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + j),
+                     maximum ? _mm_max_epu8(x, y) : _mm_min_epu8(x, y));
+  }
+#endif
+  for (; j < width; j++) {
+    out[j] = maximum ? std::max(a[j], b[j]) : std::min(a[j], b[j]);
   }
+}
 
-  GSCImage(const RGBImage &grayscaled, int dontMind) {
-    width = grayscaled.getWidth();
-    height = grayscaled.getHeight();
-    max_luminocity = grayscaled.getMaxLuminocity();
+void extremumRows(const uint16_t *a, const uint16_t *b, uint16_t *out,
+                  int width, bool maximum) {
+  for (int j = 0; j < width; j++) {
+    out[j] = maximum ? std::max(a[j], b[j]) : std::min(a[j], b[j]);
+  }
+}
 
-    pixels = new GSCPixel *[height];
-    for (int i = 0; i < height; i++) {
-      pixels[i] = new GSCPixel[width];
+// Minimum, or maximum when `maximum` is set, over the w×h rectangle that
+// starts `left` columns and `top` rows before each pixel. Both passes use van
+// Herk and Gil-Werman's algorithm: the padded line is cut into blocks as long
+// as the window, so every window is the suffix of one block followed by the
+// prefix of the next and each pixel costs three comparisons whatever the
+// window size. Outside pixels are clamped to the border, which for min and
+// max is the same as leaving them out.
+template <typename T>
+BasicPlane<T> extremumFilterPlane(const BasicPlane<T> &src, int w, int h,
+                                  int left, int top, bool maximum) {
+  const int width = src.getWidth();
+  const int height = src.getHeight();
+  auto pick = [maximum](T a, T b) { return maximum ? std::max(a, b) : std::min(a, b); };
+  BasicPlane<T> across(width, height);
+
+  parallelFor(0, height, [&](int first, int last) {
+    const int length = width + w - 1;
+    std::vector<T> padded(length), prefix(length), suffix(length);
+    for (int i = first; i < last; i++) {
+      const T *row = src.row(i);
+      for (int t = 0; t < length; t++) {
+        padded[t] = row[std::min(std::max(t - left, 0), width - 1)];
+      }
+      for (int start = 0; start < length; start += w) {
+        int end = std::min(start + w, length);
+        prefix[start] = padded[start];
+        for (int t = start + 1; t < end; t++) {
+          prefix[t] = pick(prefix[t - 1], padded[t]);
+        }
+        suffix[end - 1] = padded[end - 1];
+        for (int t = end - 2; t >= start; t--) {
+          suffix[t] = pick(padded[t], suffix[t + 1]);
+        }
+      }
+      T *out = across.row(i);
       for (int j = 0; j < width; j++) {
-        const Pixel &pixel = grayscaled.getPixel(i, j);
-        const RGBPixel &rgbPixel = dynamic_cast<const RGBPixel &>(pixel);
-        unsigned char grayValue = static_cast<unsigned char>(rgbPixel.getRed());
-        pixels[i][j] = GSCPixel(grayValue);
+        out[j] = pick(suffix[j], prefix[j + w - 1]);
       }
     }
-  }
+  });
+
+  // The vertical pass works on whole rows, so it vectorizes across columns.
+  // Each band walks its padded rows block by block, keeping the suffixes of
+  // the current block and a running prefix of the next one.
+  BasicPlane<T> dst(width, height);
+  parallelFor(0, height, [&](int first, int last) {
+    const int count = last - first;
+    std::vector<std::vector<T>> suffix(h, std::vector<T>(width));
+    std::vector<T> prefix(width);
+    auto padded = [&](int t) {
+      return across.row(std::min(std::max(first - top + t, 0), height - 1));
+    };
+
+    for (int start = 0; start < count; start += h) {
+      std::copy(padded(start + h - 1), padded(start + h - 1) + width,
+                suffix[h - 1].begin());
+      for (int t = h - 2; t >= 0; t--) {
+        extremumRows(padded(start + t), suffix[t + 1].data(), suffix[t].data(),
+                     width, maximum);
+      }
+      std::copy(suffix[0].begin(), suffix[0].end(), dst.row(first + start));
+      for (int t = 1; t < h && start + t < count; t++) {
+        if (t == 1) {
+          std::copy(padded(start + h), padded(start + h) + width, prefix.begin());
+        } else {
+          extremumRows(prefix.data(), padded(start + h + t - 1), prefix.data(),
+                       width, maximum);
+        }
+        extremumRows(suffix[t].data(), prefix.data(), dst.row(first + start + t),
+                     width, maximum);
+      }
+    }
+  }, bandWithOverlap(h));
 
-  GSCImage(std::istream &stream) {
-    stream.seekg(0);
+  return dst;
+}
 
-    std::string magicNumber;
-    stream >> magicNumber;
-    if (magicNumber != "P2") {
-      return;
-    }
+enum class Morphology { Erode, Dilate, Open, Close };
+
+// Morphology with a w×h rectangle anchored at its centre, (w - 1) / 2
+// columns from the left edge. Dilation uses the reflected rectangle, so
+// opening and closing stay idempotent for even sizes too.
+template <typename T>
+BasicPlane<T> morphologyPlane(const BasicPlane<T> &src, Morphology operation,
+                              int w, int h) {
+  auto erode = [&](const BasicPlane<T> &plane) {
+    return extremumFilterPlane(plane, w, h, (w - 1) / 2, (h - 1) / 2, false);
+  };
+  auto dilate = [&](const BasicPlane<T> &plane) {
+    return extremumFilterPlane(plane, w, h, w / 2, h / 2, true);
+  };
+  switch (operation) {
+  case Morphology::Erode:
+    return erode(src);
+  case Morphology::Dilate:
+    return dilate(src);
+  case Morphology::Open:
+    return dilate(erode(src));
+  default:
+    return erode(dilate(src));
+  }
+}
 
-    stream >> width >> height >> max_luminocity;
+// Gradient magnitude of one row from the padded rows above, at and below it
+// (width + 2 samples each). `side` and `middle` are the smoothing weights,
+// 1 2 1 for Sobel and 3 10 3 for Scharr; both derivatives are divided by
+// their sum so a step of height d has magnitude d. The SSE2 path squares and
+// adds the two derivatives with one madd and rounds like the scalar tail.
+void gradientRow(const unsigned char *above, const unsigned char *centre,
+                 const unsigned char *below, int side, int middle,
+                 int maxValue, unsigned char *out, int width) {
+  const float scale = 1.0f / (2 * side + middle);
+  int j = 0;
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i sideWeight = _mm_set1_epi16(static_cast<int16_t>(side));
+  const __m128i middleWeight = _mm_set1_epi16(static_cast<int16_t>(middle));
+  const __m128i limit = _mm_set1_epi16(static_cast<int16_t>(maxValue));
+  const __m128 factor = _mm_set1_ps(scale);
+  auto load = [&](const unsigned char *row) {
+    return _mm_unpacklo_epi8(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(row)), zero);
+  };
+  for (; j + 8 <= width; j += 8) {
+    __m128i smoothLeft = _mm_add_epi16(
+        _mm_mullo_epi16(_mm_add_epi16(load(above + j), load(below + j)), sideWeight),
+        _mm_mullo_epi16(load(centre + j), middleWeight));
+    __m128i smoothRight = _mm_add_epi16(
+        _mm_mullo_epi16(_mm_add_epi16(load(above + j + 2), load(below + j + 2)),
+                        sideWeight),
+        _mm_mullo_epi16(load(centre + j + 2), middleWeight));
+    __m128i gx = _mm_sub_epi16(smoothRight, smoothLeft);
+    __m128i outer = _mm_add_epi16(
+        _mm_sub_epi16(load(below + j), load(above + j)),
+        _mm_sub_epi16(load(below + j + 2), load(above + j + 2)));
+    __m128i gy = _mm_add_epi16(
+        _mm_mullo_epi16(outer, sideWeight),
+        _mm_mullo_epi16(_mm_sub_epi16(load(below + j + 1), load(above + j + 1)),
+                        middleWeight));
+    __m128i low = _mm_unpacklo_epi16(gx, gy);
+    __m128i high = _mm_unpackhi_epi16(gx, gy);
+    low = _mm_cvtps_epi32(_mm_mul_ps(
+        _mm_sqrt_ps(_mm_cvtepi32_ps(_mm_madd_epi16(low, low))), factor));
+    high = _mm_cvtps_epi32(_mm_mul_ps(
+        _mm_sqrt_ps(_mm_cvtepi32_ps(_mm_madd_epi16(high, high))), factor));
+    __m128i words = _mm_min_epi16(_mm_packs_epi32(low, high), limit);
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(out + j),
+                     _mm_packus_epi16(words, words));
+  }
+#endif
+  for (; j < width; j++) {
+    int gx = side * (above[j + 2] + below[j + 2] - above[j] - below[j]) +
+             middle * (centre[j + 2] - centre[j]);
+    int gy = side * (below[j] - above[j] + below[j + 2] - above[j + 2]) +
+             middle * (below[j + 1] - above[j + 1]);
+    float magnitude = std::sqrt(static_cast<float>(gx * gx + gy * gy)) * scale;
+    out[j] = static_cast<unsigned char>(
+        std::min(static_cast<int>(std::nearbyint(magnitude)), maxValue));
+  }
+}
 
-    pixels = new GSCPixel *[height];
-    for (int i = 0; i < height; i++) {
-      pixels[i] = new GSCPixel[width];
-      for (int j = 0; j < width; j++) {
-        int pixelValue;
-        stream >> pixelValue;
-        pixels[i][j] = GSCPixel(static_cast<unsigned char>(pixelValue));
+void gradientRow(const uint16_t *above, const uint16_t *centre,
+                 const uint16_t *below, int side, int middle, int maxValue,
+                 uint16_t *out, int width) {
+  const double scale = 1.0 / (2 * side + middle);
+  for (int j = 0; j < width; j++) {
+    int64_t gx = side * (int64_t(above[j + 2]) + below[j + 2] - above[j] - below[j]) +
+                 middle * (int64_t(centre[j + 2]) - centre[j]);
+    int64_t gy = side * (int64_t(below[j]) - above[j] + below[j + 2] - above[j + 2]) +
+                 middle * (int64_t(below[j + 1]) - above[j + 1]);
+    double magnitude = std::sqrt(static_cast<double>(gx * gx + gy * gy)) * scale;
+    out[j] = static_cast<uint16_t>(
+        std::min<int64_t>(static_cast<int64_t>(std::nearbyint(magnitude)), maxValue));
+  }
+}
+
+// Sobel or Scharr gradient magnitude, clamped to `maxValue`.
+template <typename T>
+BasicPlane<T> gradientPlane(const BasicPlane<T> &src, bool scharr,
+                            EdgeMode edge, int maxValue) {
+  const int width = src.getWidth();
+  const int height = src.getHeight();
+  const int side = scharr ? 3 : 1;
+  const int middle = scharr ? 10 : 2;
+  BasicPlane<T> dst(width, height);
+
+  parallelFor(0, height, [&](int first, int last) {
+    std::vector<std::vector<T>> rows(3, std::vector<T>(width + 2));
+    for (int i = first; i < last; i++) {
+      for (int k = 0; k < 3; k++) {
+        int source = edgeIndex(i - 1 + k, height, edge);
+        if (source < 0) {
+          std::fill(rows[k].begin(), rows[k].end(), 0);
+        } else {
+          padRow(src.row(source), width, 1, edge, rows[k].data());
+        }
       }
+      gradientRow(rows[0].data(), rows[1].data(), rows[2].data(), side, middle,
+                  maxValue, dst.row(i), width);
     }
+  });
+
+  return dst;
+}
+
+// Samples above `level` become `on`, the others zero.
+void thresholdRow(const unsigned char *in, int level, int on,
+                  unsigned char *out, int width) {
+  level = std::min(level, 255);
+  int j = 0;
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i bound = _mm_set1_epi8(static_cast<char>(level));
+  const __m128i value = _mm_set1_epi8(static_cast<char>(on));
+  for (; j + 16 <= width; j += 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + j));
+    __m128i below = _mm_cmpeq_epi8(_mm_subs_epu8(x, bound), zero);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + j),
+                     _mm_andnot_si128(below, value));
+  }
+#endif
+  for (; j < width; j++) {
+    out[j] = in[j] > level ? static_cast<unsigned char>(on) : 0;
   }
+}
 
-~GSCImage() {
-    for (int i = 0; i < height; i++) {
-        delete[] pixels[i];
+void thresholdRow(const uint16_t *in, int level, int on, uint16_t *out,
+                  int width) {
+  for (int j = 0; j < width; j++) {
+    out[j] = in[j] > level ? static_cast<uint16_t>(on) : 0;
+  }
+}
+
+template <typename T>
+BasicPlane<T> thresholdPlane(const BasicPlane<T> &src, int level, int on) {
+  BasicPlane<T> dst(src.getWidth(), src.getHeight());
+  parallelFor(0, src.getHeight(), [&](int first, int last) {
+    for (int i = first; i < last; i++) {
+      thresholdRow(src.row(i), level, on, dst.row(i), src.getWidth());
     }
-    delete[] pixels;
+  });
+  return dst;
 }
 
-  GSCImage &operator=(const GSCImage &img) {
-    if (this != &img) {
-      for (int i = 0; i < height; i++) {
-        delete[] pixels[i];
-      }
-      delete[] pixels;
+// Integral and squared-integral image of one channel, stored with a zero
+// first row and column so the sum over any rectangle is four lookups.
+class SummedAreaTable {
+private:
+  int width;
+  int height;
+  std::vector<uint64_t> sums;
+  std::vector<uint64_t> squares;
 
-      width = img.width;
-      height = img.height;
-      max_luminocity = img.max_luminocity;
+  size_t at(int row, int col) const {
+    return static_cast<size_t>(row) * (width + 1) + col;
+  }
 
-      pixels = new GSCPixel *[height];
-      for (int i = 0; i < height; i++) {
-        pixels[i] = new GSCPixel[width];
+  uint64_t rectangle(const std::vector<uint64_t> &table, int x, int y, int w,
+                     int h) const {
+    return table[at(y + h, x + w)] - table[at(y, x + w)] -
+           table[at(y + h, x)] + table[at(y, x)];
+  }
+
+public:
+  template <typename T>
+  SummedAreaTable(const BasicPlane<T> &plane)
+      : width(plane.getWidth()), height(plane.getHeight()),
+        sums(static_cast<size_t>(width + 1) * (height + 1), 0),
+        squares(sums.size(), 0) {
+    // Row prefix sums, one band of rows per thread...
+    parallelFor(0, height, [&](int first, int last) {
+      for (int i = first; i < last; i++) {
+        const T *row = plane.row(i);
+        uint64_t runningSum = 0, runningSquare = 0;
         for (int j = 0; j < width; j++) {
-          pixels[i][j] = img.pixels[i][j];
+          runningSum += row[j];
+          runningSquare += static_cast<uint64_t>(row[j]) * row[j];
+          sums[at(i + 1, j + 1)] = runningSum;
+          squares[at(i + 1, j + 1)] = runningSquare;
         }
       }
-    }
-    return *this;
+    });
+
+    // ...then accumulated down the columns, one strip per thread.
+    parallelFor(1, width + 1, [&](int first, int last) {
+      for (int i = 1; i <= height; i++) {
+        for (int j = first; j < last; j++) {
+          sums[at(i, j)] += sums[at(i - 1, j)];
+          squares[at(i, j)] += squares[at(i - 1, j)];
+        }
+      }
+    });
   }
 
-  virtual Image &operator+=(int times) override {
-    if (times > 0) {
-     times %= 4;
-      for (int t = 0; t < times; t++) {
-        GSCPixel **rotatedPixels = new GSCPixel *[width];
-        for (int i = 0; i < width; i++) {
-          rotatedPixels[i] = new GSCPixel[height];
-          for (int j = 0; j < height; j++) {
-            rotatedPixels[i][j] = pixels[height - j - 1][i];
-          }
-        }
+  int getWidth() const { return width; }
+  int getHeight() const { return height; }
 
-        std::swap(width, height);
-        for (int i = 0; i < width; i++) {
-          delete[] pixels[i];
-        }
-        delete[] pixels;
-        pixels = rotatedPixels;
-      }
-    } else if (times < 0) {
-      times = std::abs(times);
-      times %= 4;
-      for (int t = 0; t < times; t++) {
-        GSCPixel **rotatedPixels = new GSCPixel *[width];
-        for (int i = 0; i < width; i++) {
-          rotatedPixels[i] = new GSCPixel[height];
-          for (int j = 0; j < height; j++) {
-            rotatedPixels[i][j] = pixels[j][width - i - 1];
-          }
-        }
+  uint64_t sum(int x, int y, int w, int h) const {
+    return rectangle(sums, x, y, w, h);
+  }
 
-        std::swap(width, height);
-        for (int i = 0; i < width; i++) {
-          delete[] pixels[i];
-        }
-        delete[] pixels;
-        pixels = rotatedPixels;
+  uint64_t sumOfSquares(int x, int y, int w, int h) const {
+    return rectangle(squares, x, y, w, h);
+  }
+};
+
+// Minimum and maximum of one channel over any rectangle. The channel is cut
+// into 16×16 blocks whose extremes are kept next to a 16-bit copy of the
+// samples, about 2 bytes per pixel in all. A query combines the blocks the
+// rectangle covers completely and scans only the samples of the partly
+// covered ones along its border.
+class BlockExtremes {
+private:
+  static const int side = 16;
+  int width;
+  int height;
+  int blocksX;
+  int blocksY;
+  std::vector<uint16_t> samples;
+  std::vector<uint16_t> minimum;
+  std::vector<uint16_t> maximum;
+
+  void scan(int x, int y, int w, int h, int &low, int &high) const {
+    for (int i = y; i < y + h; i++) {
+      const uint16_t *row = &samples[static_cast<size_t>(i) * width];
+      for (int j = x; j < x + w; j++) {
+        low = std::min(low, static_cast<int>(row[j]));
+        high = std::max(high, static_cast<int>(row[j]));
       }
     }
-
-    return *this;
   }
 
-  virtual Image &operator*=(double factor) override {
-    int newWidth = static_cast<int>(width * factor);
-    int newHeight = static_cast<int>(height * factor);
-
-    GSCPixel **resizedPixels = new GSCPixel *[newHeight];
-    for (int i = 0; i < newHeight; i++) {
-      resizedPixels[i] = new GSCPixel[newWidth];
-      for (int j = 0; j < newWidth; j++) {
-        int r1 = std::min(static_cast<int>(std::floor(i / factor)), height - 1);
-        int r2 = std::min(static_cast<int>(std::ceil(i / factor)), height - 1);
-        int c1 = std::min(static_cast<int>(std::floor(j / factor)), width - 1);
-        int c2 = std::min(static_cast<int>(std::ceil(j / factor)), width - 1);
+public:
+  template <typename T>
+  BlockExtremes(const BasicPlane<T> &plane)
+      : width(plane.getWidth()), height(plane.getHeight()),
+        blocksX(width / side), blocksY(height / side),
+        samples(static_cast<size_t>(width) * height),
+        minimum(static_cast<size_t>(blocksX) * blocksY),
+        maximum(minimum.size()) {
+    parallelFor(0, height, [&](int first, int last) {
+      for (int i = first; i < last; i++) {
+        std::copy(plane.row(i), plane.row(i) + width,
+                  &samples[static_cast<size_t>(i) * width]);
+      }
+    });
+    parallelFor(0, blocksY, [&](int first, int last) {
+      for (int by = first; by < last; by++) {
+        for (int bx = 0; bx < blocksX; bx++) {
+          int low = 65535, high = 0;
+          scan(bx * side, by * side, side, side, low, high);
+          minimum[static_cast<size_t>(by) * blocksX + bx] = static_cast<uint16_t>(low);
+          maximum[static_cast<size_t>(by) * blocksX + bx] = static_cast<uint16_t>(high);
+        }
+      }
+    });
+  }
 
-        int value = static_cast<int>((pixels[r1][c1].getValue() + pixels[r1][c2].getValue() +
-                     pixels[r2][c1].getValue() + pixels[r2][c2].getValue())/4);
-		  
-        resizedPixels[i][j] = GSCPixel(static_cast<unsigned char>(value));
+  void query(int x, int y, int w, int h, int &low, int &high) const {
+    low = 65535;
+    high = 0;
+    // Whole blocks inside the rectangle
+    int left = (x + side - 1) / side, right = (x + w) / side;
+    int top = (y + side - 1) / side, bottom = (y + h) / side;
+    if (left >= right || top >= bottom) {
+      scan(x, y, w, h, low, high);
+      return;
+    }
+    for (int by = top; by < bottom; by++) {
+      for (int bx = left; bx < right; bx++) {
+        low = std::min(low, static_cast<int>(minimum[static_cast<size_t>(by) * blocksX + bx]));
+        high = std::max(high, static_cast<int>(maximum[static_cast<size_t>(by) * blocksX + bx]));
       }
     }
+    // The border strips around them
+    scan(x, y, w, top * side - y, low, high);
+    scan(x, bottom * side, w, y + h - bottom * side, low, high);
+    scan(x, top * side, left * side - x, (bottom - top) * side, low, high);
+    scan(right * side, top * side, x + w - right * side, (bottom - top) * side,
+         low, high);
+  }
+};
 
-    for (int i = 0; i < height; i++) {
-      delete[] pixels[i];
-    }
-	delete[] pixels;
+struct RegionStatistics {
+  double mean;
+  double variance;
+  int minimum;
+  int maximum;
+};
 
-    width = newWidth;
-    height = newHeight;
-    pixels = resizedPixels;
+// How far one channel is from another: the largest absolute difference,
+// the sum of squared differences and the mean SSIM.
+struct ChannelComparison {
+  int maximum = 0;
+  uint64_t squares = 0;
+  double ssim = 1;
+};
 
-    return *this;
+// Largest |a - b| and sum of (a - b)^2 over a row, also writing |a - b| to
+// `difference` unless it is null. The SSE2 path takes |a - b| from two
+// saturating subtractions and squares it with _mm_madd_epi16; a 16-sample
+// step adds at most 4 * 255^2 to a 32-bit lane, so lanes are flushed every
+// 4096 steps.
+void compareRow(const unsigned char *a, const unsigned char *b, int count,
+                unsigned char *difference, int &maximum, uint64_t &squares) {
+  int j = 0;
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  __m128i largest = zero;
+  while (j + 16 <= count) {
+    __m128i sum = zero;
+    for (int steps = 0; steps < 4096 && j + 16 <= count; steps++, j += 16) {
+      __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + j));
+      __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + j));
+      __m128i d = _mm_or_si128(_mm_subs_epu8(x, y), _mm_subs_epu8(y, x));
+      largest = _mm_max_epu8(largest, d);
+      if (difference) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(difference + j), d);
+      }
+      __m128i low = _mm_unpacklo_epi8(d, zero);
+      __m128i high = _mm_unpackhi_epi8(d, zero);
+      sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_madd_epi16(low, low),
+                                             _mm_madd_epi16(high, high)));
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), sum);
+    squares += static_cast<uint64_t>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+  }
+  unsigned char bytes[16];
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(bytes), largest);
+  for (unsigned char value : bytes) {
+    maximum = std::max<int>(maximum, value);
   }
+#endif
+  for (; j < count; j++) {
+    int d = std::abs(a[j] - b[j]);
+    maximum = std::max(maximum, d);
+    squares += static_cast<uint64_t>(d * d);
+    if (difference) {
+      difference[j] = static_cast<unsigned char>(d);
+    }
+  }
+}
 
-  virtual Image &operator!() override {
-    for (int i = 0; i < height; i++) {
-      for (int j = 0; j < width; j++) {
-        unsigned char value = pixels[i][j].getValue();
-        pixels[i][j].setValue(max_luminocity - value);
-      }
+// The same for 16-bit samples, whose squares need 64-bit sums.
+void compareRow(const uint16_t *a, const uint16_t *b, int count,
+                uint16_t *difference, int &maximum, uint64_t &squares) {
+  for (int j = 0; j < count; j++) {
+    int d = std::abs(a[j] - b[j]);
+    maximum = std::max(maximum, d);
+    squares += static_cast<uint64_t>(d) * d;
+    if (difference) {
+      difference[j] = static_cast<uint16_t>(d);
     }
-    return *this;
   }
+}
 
-  virtual Image &operator~() override {
-    // Calculate histogram
-    int histogram[256] = {0};
+// Sums of a, b, a^2, b^2 and ab over a 4x4 block of two channels.
+struct SsimBlock {
+  uint64_t a, b, aa, bb, ab;
+};
 
-    for (int i = 0; i < height; i++) {
-      for (int j = 0; j < width; j++) {
-        unsigned char luminance = pixels[i][j].getValue();
-        histogram[luminance]++;
+// Fills blocks[0, groups) from four rows of two channels, block k covering
+// columns 4k to 4k + 3. The SSE2 path sums four blocks at a time:
+// _mm_madd_epi16 adds neighbouring columns, and neighbouring pairs are
+// added once all four rows are in.
+void sumSsimBlocks(const unsigned char *const *a, const unsigned char *const *b,
+                   int groups, SsimBlock *blocks) {
+  int k = 0;
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+  for (; k + 4 <= groups; k += 4) {
+    // Low and high halves of each sum: pairs of columns in 32-bit lanes
+    __m128i sums[5][2];
+    for (auto &sum : sums) {
+      sum[0] = sum[1] = zero;
+    }
+    for (int r = 0; r < 4; r++) {
+      __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a[r] + 4 * k));
+      __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b[r] + 4 * k));
+      __m128i xs[2] = {_mm_unpacklo_epi8(x, zero), _mm_unpackhi_epi8(x, zero)};
+      __m128i ys[2] = {_mm_unpacklo_epi8(y, zero), _mm_unpackhi_epi8(y, zero)};
+      for (int h = 0; h < 2; h++) {
+        sums[0][h] = _mm_add_epi32(sums[0][h], _mm_madd_epi16(xs[h], ones));
+        sums[1][h] = _mm_add_epi32(sums[1][h], _mm_madd_epi16(ys[h], ones));
+        sums[2][h] = _mm_add_epi32(sums[2][h], _mm_madd_epi16(xs[h], xs[h]));
+        sums[3][h] = _mm_add_epi32(sums[3][h], _mm_madd_epi16(ys[h], ys[h]));
+        sums[4][h] = _mm_add_epi32(sums[4][h], _mm_madd_epi16(xs[h], ys[h]));
       }
     }
-
-    // Calculate probability distribution
-    double probabilityDistribution[256];
-    for (int i = 0; i <= 255; i++) {
-      probabilityDistribution[i] = static_cast<double>(histogram[i]) / (width * height);
+    uint32_t pairs[5][8];
+    for (int q = 0; q < 5; q++) {
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(pairs[q]), sums[q][0]);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(pairs[q] + 4), sums[q][1]);
     }
+    for (int g = 0; g < 4; g++) {
+      blocks[k + g] = {pairs[0][2 * g] + pairs[0][2 * g + 1],
+                       pairs[1][2 * g] + pairs[1][2 * g + 1],
+                       pairs[2][2 * g] + pairs[2][2 * g + 1],
+                       pairs[3][2 * g] + pairs[3][2 * g + 1],
+                       pairs[4][2 * g] + pairs[4][2 * g + 1]};
+    }
+  }
+#endif
+  for (; k < groups; k++) {
+    SsimBlock block = {0, 0, 0, 0, 0};
+    for (int r = 0; r < 4; r++) {
+      for (int j = 4 * k; j < 4 * k + 4; j++) {
+        uint64_t x = a[r][j];
+        uint64_t y = b[r][j];
+        block.a += x;
+        block.b += y;
+        block.aa += x * x;
+        block.bb += y * y;
+        block.ab += x * y;
+      }
+    }
+    blocks[k] = block;
+  }
+}
 
-    // Calculate cumulative probability distribution
-    double cumulativeDistribution[256];
-    cumulativeDistribution[0] = probabilityDistribution[0];
-    for (int i = 1; i <= 255; i++) {
-      cumulativeDistribution[i] = cumulativeDistribution[i - 1] + probabilityDistribution[i];
+void sumSsimBlocks(const uint16_t *const *a, const uint16_t *const *b,
+                   int groups, SsimBlock *blocks) {
+  for (int k = 0; k < groups; k++) {
+    SsimBlock block = {0, 0, 0, 0, 0};
+    for (int r = 0; r < 4; r++) {
+      for (int j = 4 * k; j < 4 * k + 4; j++) {
+        uint64_t x = a[r][j];
+        uint64_t y = b[r][j];
+        block.a += x;
+        block.b += y;
+        block.aa += x * x;
+        block.bb += y * y;
+        block.ab += x * y;
+      }
     }
+    blocks[k] = block;
+  }
+}
 
-    // Calculate new luminance values
-    int newLuminance[256];
-    for (int i = 0; i <= 255; i++) {
-      newLuminance[i] = static_cast<unsigned char>(cumulativeDistribution[i] * 255);
+// SSIM of a window from its sums over `count` samples, with the usual
+// constants (0.01 L)^2 and (0.03 L)^2 for samples up to L.
+double windowSsim(const SsimBlock &sums, double count, int maxValue) {
+  double c1 = 0.0001 * maxValue * maxValue;
+  double c2 = 0.0009 * maxValue * maxValue;
+  double meanA = sums.a / count;
+  double meanB = sums.b / count;
+  double varianceA = sums.aa / count - meanA * meanA;
+  double varianceB = sums.bb / count - meanB * meanB;
+  double covariance = sums.ab / count - meanA * meanB;
+  return (2 * meanA * meanB + c1) * (2 * covariance + c2) /
+         ((meanA * meanA + meanB * meanB + c1) * (varianceA + varianceB + c2));
+}
+
+// Compares two channels of the same size. SSIM is averaged over 8x8
+// windows placed every 4 samples, as libvpx does, so every window is four
+// 4x4 blocks summed once by sumSsimBlocks(); a channel smaller than a
+// window is one window. `difference`, unless null, receives |a - b|.
+template <typename T>
+ChannelComparison compareChannels(const BasicPlane<T> &a, const BasicPlane<T> &b,
+                                  int maxValue, BasicPlane<T> *difference) {
+  const int width = a.getWidth();
+  const int height = a.getHeight();
+  ChannelComparison result;
+  std::vector<int> maxima(height, 0);
+  std::vector<uint64_t> squares(height, 0);
+  parallelFor(0, height, [&](int first, int last) {
+    for (int i = first; i < last; i++) {
+      compareRow(a.row(i), b.row(i), width, difference ? difference->row(i) : nullptr,
+                 maxima[i], squares[i]);
     }
+  });
+  for (int i = 0; i < height; i++) {
+    result.maximum = std::max(result.maximum, maxima[i]);
+    result.squares += squares[i];
+  }
 
-    // Apply luminance transformation to the image
+  if (width < 8 || height < 8) {
+    SsimBlock whole = {0, 0, 0, 0, 0};
     for (int i = 0; i < height; i++) {
       for (int j = 0; j < width; j++) {
-        unsigned char currentLuminance = pixels[i][j].getValue();
-		
-        unsigned char newPixelValue =  static_cast<unsigned char>(newLuminance[currentLuminance]);
-        pixels[i][j].setValue(newPixelValue);
+        uint64_t x = a.row(i)[j];
+        uint64_t y = b.row(i)[j];
+        whole.a += x;
+        whole.b += y;
+        whole.aa += x * x;
+        whole.bb += y * y;
+        whole.ab += x * y;
       }
     }
-
-    return *this;
+    result.ssim = windowSsim(whole, static_cast<double>(width) * height, maxValue);
+    return result;
   }
 
-  virtual Image &operator*() override {
-    for (int i = 0; i < height; i++) {
-      for (int j = 0; j < width / 2; j++) {
-        std::swap(pixels[i][j], pixels[i][width - j - 1]);
+  const int groups = width / 4;
+  const int blockRows = height / 4;
+  std::vector<SsimBlock> blocks(static_cast<size_t>(groups) * blockRows);
+  parallelFor(0, blockRows, [&](int first, int last) {
+    for (int r = first; r < last; r++) {
+      const T *rowsA[4];
+      const T *rowsB[4];
+      for (int k = 0; k < 4; k++) {
+        rowsA[k] = a.row(4 * r + k);
+        rowsB[k] = b.row(4 * r + k);
       }
+      sumSsimBlocks(rowsA, rowsB, groups, &blocks[static_cast<size_t>(r) * groups]);
     }
+  });
+
+  std::vector<double> rowTotals(blockRows - 1, 0.0);
+  parallelFor(0, blockRows - 1, [&](int first, int last) {
+    for (int r = first; r < last; r++) {
+      const SsimBlock *top = &blocks[static_cast<size_t>(r) * groups];
+      const SsimBlock *bottom = top + groups;
+      for (int k = 0; k + 1 < groups; k++) {
+        SsimBlock window = {
+            top[k].a + top[k + 1].a + bottom[k].a + bottom[k + 1].a,
+            top[k].b + top[k + 1].b + bottom[k].b + bottom[k + 1].b,
+            top[k].aa + top[k + 1].aa + bottom[k].aa + bottom[k + 1].aa,
+            top[k].bb + top[k + 1].bb + bottom[k].bb + bottom[k + 1].bb,
+            top[k].ab + top[k + 1].ab + bottom[k].ab + bottom[k + 1].ab};
+        rowTotals[r] += windowSsim(window, 64, maxValue);
+      }
+    }
+  });
+  double total = 0;
+  for (double rowTotal : rowTotals) {
+    total += rowTotal;
+  }
+  result.ssim = total / (static_cast<double>(blockRows - 1) * (groups - 1));
+  return result;
+}
+
+// Averages every factorX x factorY block of a full-resolution chroma plane
+// into one sample. Blocks cut by the right or bottom edge average what they
+// have.
+Plane downsampleChroma(const Plane &full, int factorX, int factorY) {
+  Plane chroma((full.getWidth() + factorX - 1) / factorX,
+               (full.getHeight() + factorY - 1) / factorY);
+  parallelFor(0, chroma.getHeight(), [&](int first, int last) {
+    for (int i = first; i < last; i++) {
+      int top = i * factorY;
+      int rows = std::min(factorY, full.getHeight() - top);
+      unsigned char *out = chroma.row(i);
+      for (int j = 0; j < chroma.getWidth(); j++) {
+        int left = j * factorX;
+        int columns = std::min(factorX, full.getWidth() - left);
+        int sum = 0;
+        for (int r = 0; r < rows; r++) {
+          for (int c = 0; c < columns; c++) {
+            sum += full.row(top + r)[left + c];
+          }
+        }
+        out[j] = static_cast<unsigned char>((sum + rows * columns / 2) /
+                                            (rows * columns));
+      }
+    }
+  });
+  return chroma;
+}
+
+// Interpolates a chroma plane back to width x height. Samples sit at the
+// centre of their block, so with a factor of 2 every output pixel blends its
+// two nearest samples 3:1, as libjpeg's "fancy" upsampling does.
+Plane upsampleChroma(const Plane &chroma, int width, int height, int factorX,
+                     int factorY) {
+  // Positions in quarter samples: (2x + 1) / (2 * factor) - 1/2
+  auto taps = [](int n, int factor, int samples, std::vector<int> &index,
+                 std::vector<int> &weight) {
+    for (int x = 0; x < n; x++) {
+      int position = 2 * (2 * x + 1) / factor - 2;
+      int base = position >= 0 ? position / 4 : -1;
+      index.push_back(std::min(std::max(base, 0), samples - 1));
+      index.push_back(std::min(std::max(base + 1, 0), samples - 1));
+      weight.push_back(position - 4 * base);
+    }
+  };
+  std::vector<int> columns, columnWeights, rows, rowWeights;
+  taps(width, factorX, chroma.getWidth(), columns, columnWeights);
+  taps(height, factorY, chroma.getHeight(), rows, rowWeights);
+
+  Plane full(width, height);
+  parallelFor(0, height, [&](int first, int last) {
+    for (int i = first; i < last; i++) {
+      const unsigned char *upper = chroma.row(rows[2 * i]);
+      const unsigned char *lower = chroma.row(rows[2 * i + 1]);
+      int wy = rowWeights[i];
+      unsigned char *out = full.row(i);
+      for (int j = 0; j < width; j++) {
+        int a = columns[2 * j], b = columns[2 * j + 1], wx = columnWeights[j];
+        int top = (4 - wx) * upper[a] + wx * upper[b];
+        int bottom = (4 - wx) * lower[a] + wx * lower[b];
+        out[j] = static_cast<unsigned char>(((4 - wy) * top + wy * bottom + 8) >> 4);
+      }
+    }
+  });
+  return full;
+}
+
+// Turns a plane clockwise by `turns` quarter turns (negative turns go
+// counterclockwise), with the same pixel mapping as the `r` command.
+Plane rotatePlane(const Plane &plane, int turns) {
+  turns = ((turns % 4) + 4) % 4;
+  int width = plane.getWidth();
+  int height = plane.getHeight();
+  if (turns == 0) {
+    return plane;
+  }
+
+  Plane rotated = turns == 2 ? Plane(width, height) : Plane(height, width);
+  forEachTile(rotated.getWidth(), rotated.getHeight(),
+              [&](int x, int y, int w, int h) {
+    const unsigned char *source = plane.row(0);
+    for (int i = y; i < y + h; i++) {
+      int row, col, rowStep, colStep;
+      rotatedSource(i, x, width, height, turns, row, col, rowStep, colStep);
+      ptrdiff_t at = static_cast<ptrdiff_t>(row) * width + col;
+      const ptrdiff_t step = static_cast<ptrdiff_t>(rowStep) * width + colStep;
+      unsigned char *out = rotated.row(i);
+      for (int j = x; j < x + w; j++, at += step) {
+        out[j] = source[at];
+      }
+    }
+  });
+  return rotated;
+}
+
+// Pixel-grid counterpart of rotatePlane for the RGB and grayscale images:
+// returns freshly allocated rows holding `pixels` turned by 1 to 3 quarter
+// turns, filled tile by tile.
+template <typename P>
+P **rotatePixels(P *const *pixels, int width, int height, int turns) {
+  int rotatedWidth = turns == 2 ? width : height;
+  int rotatedHeight = turns == 2 ? height : width;
+  P **rotated = allocatePixels<P>(rotatedWidth, rotatedHeight);
+  forEachTile(rotatedWidth, rotatedHeight, [&](int x, int y, int w, int h) {
+    for (int i = y; i < y + h; i++) {
+      int row, col, rowStep, colStep;
+      rotatedSource(i, x, width, height, turns, row, col, rowStep, colStep);
+      for (int j = x; j < x + w; j++, row += rowStep, col += colStep) {
+        rotated[i][j] = pixels[row][col];
+      }
+    }
+  });
+  return rotated;
+}
+
+Plane mirrorPlane(const Plane &plane) {
+  Plane mirrored(plane.getWidth(), plane.getHeight());
+  parallelFor(0, plane.getHeight(), [&](int first, int last) {
+    for (int i = first; i < last; i++) {
+      std::reverse_copy(plane.row(i), plane.row(i) + plane.getWidth(),
+                        mirrored.row(i));
+    }
+  });
+  return mirrored;
+}
+
+// Resamples to width x height by averaging the floor/ceil neighbours of
+// (i / factorY, j / factorX), the scheme the `s` command uses on pixels.
+template <typename T>
+BasicPlane<T> scalePlane(const BasicPlane<T> &plane, int width, int height,
+                         double factorX, double factorY) {
+  BasicPlane<T> scaled(width, height);
+  int sourceWidth = plane.getWidth();
+  int sourceHeight = plane.getHeight();
+  parallelFor(0, height, [&](int first, int last) {
+    for (int i = first; i < last; i++) {
+      int r1 = std::min(static_cast<int>(std::floor(i / factorY)), sourceHeight - 1);
+      int r2 = std::min(static_cast<int>(std::ceil(i / factorY)), sourceHeight - 1);
+      T *out = scaled.row(i);
+      for (int j = 0; j < width; j++) {
+        int c1 = std::min(static_cast<int>(std::floor(j / factorX)), sourceWidth - 1);
+        int c2 = std::min(static_cast<int>(std::ceil(j / factorX)), sourceWidth - 1);
+        int sum = plane.row(r1)[c1] + plane.row(r1)[c2] + plane.row(r2)[c1] +
+                  plane.row(r2)[c2];
+        out[j] = static_cast<T>(sum / 4);
+      }
+    }
+  });
+  return scaled;
+}
+
+// Size an import is shrunk to: by `scale` (the sizes `s` would give), or
+// so that its longer side is `maxSide`. Imports are never enlarged.
+struct ShrinkTarget {
+  double scale = 1;
+  int maxSide = 0;
+
+  bool isSet() const { return scale < 1 || maxSide > 0; }
+
+  void apply(int width, int height, int &newWidth, int &newHeight) const {
+    newWidth = width;
+    newHeight = height;
+    if (maxSide > 0 && std::max(width, height) > maxSide) {
+      newWidth = static_cast<int>(static_cast<int64_t>(width) * maxSide /
+                                  std::max(width, height));
+      newHeight = static_cast<int>(static_cast<int64_t>(height) * maxSide /
+                                   std::max(width, height));
+    } else if (maxSide == 0 && scale < 1) {
+      newWidth = static_cast<int>(width * scale);
+      newHeight = static_cast<int>(height * scale);
+    }
+    newWidth = std::max(newWidth, 1);
+    newHeight = std::max(newHeight, 1);
+  }
+};
+
+// Which output sample each of `size` input samples falls in when `size`
+// samples are shrunk to `target`, and how many inputs each output gets.
+void shrinkBoxes(int size, int target, std::vector<int> &index,
+                 std::vector<int> &counts) {
+  index.resize(size);
+  counts.assign(target, 0);
+  for (int x = 0; x < size; x++) {
+    index[x] = static_cast<int>(static_cast<int64_t>(x) * target / size);
+    counts[index[x]]++;
+  }
+}
+
+// Area-average downscale: every output sample is the rounded mean of the
+// box of input samples mapped onto it by shrinkBoxes().
+template <typename T>
+BasicPlane<T> shrinkPlane(const BasicPlane<T> &plane, int width, int height) {
+  std::vector<int> columns, columnCounts, rows, rowCounts;
+  shrinkBoxes(plane.getWidth(), width, columns, columnCounts);
+  shrinkBoxes(plane.getHeight(), height, rows, rowCounts);
+  BasicPlane<T> shrunk(width, height);
+  parallelFor(0, height, [&](int first, int last) {
+    std::vector<uint64_t> sums(width);
+    int y = static_cast<int>((static_cast<int64_t>(first) * plane.getHeight() +
+                              height - 1) / height);
+    for (int i = first; i < last; i++) {
+      std::fill(sums.begin(), sums.end(), 0);
+      for (; y < plane.getHeight() && rows[y] == i; y++) {
+        const T *row = plane.row(y);
+        for (int x = 0; x < plane.getWidth(); x++) {
+          sums[columns[x]] += row[x];
+        }
+      }
+      T *out = shrunk.row(i);
+      for (int j = 0; j < width; j++) {
+        uint64_t count = static_cast<uint64_t>(rowCounts[i]) * columnCounts[j];
+        out[j] = static_cast<T>((sums[j] + count / 2) / count);
+      }
+    }
+  });
+  return shrunk;
+}
+
+// Copies a plane into another sample type, saturating when narrowing.
+template <typename To, typename From>
+BasicPlane<To> convertPlane(const BasicPlane<From> &plane) {
+  BasicPlane<To> converted(plane.getWidth(), plane.getHeight());
+  for (int i = 0; i < plane.getHeight(); i++) {
+    const From *row = plane.row(i);
+    To *out = converted.row(i);
+    for (int j = 0; j < plane.getWidth(); j++) {
+      out[j] = static_cast<To>(std::min<int>(row[j], std::numeric_limits<To>::max()));
+    }
+  }
+  return converted;
+}
+
+// Runs a geometric plane operation on a subsampled chroma plane. When the
+// operation maps chroma blocks onto chroma blocks it works on the small plane
+// directly; otherwise (odd image sizes, or 4:2:2 turned sideways) it goes
+// through full resolution and subsamples the result again.
+template <typename Operation>
+Plane transformChroma(const Plane &chroma, int width, int height, int factorX,
+                      int factorY, bool aligned, Operation operation) {
+  if (aligned) {
+    return operation(chroma);
+  }
+  Plane full = operation(upsampleChroma(chroma, width, height, factorX, factorY));
+  return downsampleChroma(full, factorX, factorY);
+}
+
+// Counts the values of a plane, one partial histogram per row band.
+std::vector<uint64_t> countPlane(const Plane &plane) {
+  std::vector<uint64_t> counts(256, 0);
+  std::mutex merge;
+  parallelFor(0, plane.getHeight(), [&](int first, int last) {
+    uint64_t band[256] = {0};
+    for (int i = first; i < last; i++) {
+      const unsigned char *row = plane.row(i);
+      for (int j = 0; j < plane.getWidth(); j++) {
+        band[row[j]]++;
+      }
+    }
+    std::lock_guard<std::mutex> lock(merge);
+    for (int v = 0; v < 256; v++) {
+      counts[v] += band[v];
+    }
+  });
+  return counts;
+}
+
+// 16-bit version with `bins` = maxval + 1 bins. Samples above the last bin
+// are counted in it.
+std::vector<uint64_t> countPlane(const WidePlane &plane, int bins) {
+  std::vector<uint64_t> counts(bins, 0);
+  std::mutex merge;
+  parallelFor(0, plane.getHeight(), [&](int first, int last) {
+    std::vector<uint64_t> band(bins, 0);
+    for (int i = first; i < last; i++) {
+      const uint16_t *row = plane.row(i);
+      for (int j = 0; j < plane.getWidth(); j++) {
+        band[std::min<int>(row[j], bins - 1)]++;
+      }
+    }
+    std::lock_guard<std::mutex> lock(merge);
+    for (int v = 0; v < bins; v++) {
+      counts[v] += band[v];
+    }
+  });
+  return counts;
+}
+
+RegionStatistics histogramStatistics(const std::vector<uint64_t> &counts) {
+  RegionStatistics stats = {0.0, 0.0, -1, 0};
+  uint64_t total = 0;
+  double sum = 0.0, squares = 0.0;
+  for (int v = 0; v < static_cast<int>(counts.size()); v++) {
+    if (counts[v] == 0) {
+      continue;
+    }
+    if (stats.minimum < 0) {
+      stats.minimum = v;
+    }
+    stats.maximum = v;
+    total += counts[v];
+    sum += static_cast<double>(v) * counts[v];
+    squares += static_cast<double>(v) * v * counts[v];
+  }
+  if (total > 0) {
+    stats.mean = sum / total;
+    stats.variance = std::max(0.0, squares / total - stats.mean * stats.mean);
+  }
+  stats.minimum = std::max(stats.minimum, 0);
+  return stats;
+}
+
+// Luma of an RGB triple, the Y component of the YUV conversion. For samples
+// deeper than 8 bits the black offset of 16 is scaled to the same range.
+int lumaOf(int red, int green, int blue, int maxValue = 255) {
+  return ((66 * red + 129 * green + 25 * blue + 128) >> 8) +
+         (16 * maxValue + 127) / 255;
+}
+
+// The Y mapping of `z` on 8-bit images: every luma value goes to 235 times
+// its cumulative share of the pixels. Shared by the YUV equalization and the
+// fused RGB kernel, so the two stay bit-identical.
+void lumaEqualizationMap(const std::vector<uint64_t> &luminanceHistogram,
+                         int width, int height, int *newLuminance) {
+  // Calculate probability distribution
+  double probabilityDistribution[256];
+  for (int i = 0; i <= 255; i++) {
+    probabilityDistribution[i] = static_cast<double>(luminanceHistogram[i]) / (width * height);
+  }
+
+  // Calculate cumulative probability distribution
+  double cumulativeDistribution[256];
+  cumulativeDistribution[0] = probabilityDistribution[0];
+  for (int i = 1; i <= 255; i++) {
+    cumulativeDistribution[i] = cumulativeDistribution[i - 1] + probabilityDistribution[i];
+  }
+
+  // Calculate new luminance values
+  for (int i = 0; i <= 255; i++) {
+    newLuminance[i] = static_cast<int>(cumulativeDistribution[i] * 235);
+  }
+}
+
+// Netpbm allows a maxval of up to 65535. Samples above maxval are clamped.
+int clampMaxval(int maxValue) { return std::min(std::max(maxValue, 1), 65535); }
+
+int clampSample(int value, int maxValue) {
+  return std::min(std::max(value, 0), maxValue);
+}
+
+// Per-channel and luma histograms of an image. An empty vector means "not
+// known"; it is counted on first use. Operators that only move pixels keep
+// them, and negation and equalization remap the bins instead of recounting.
+struct ImageHistogram {
+  std::vector<std::vector<uint64_t>> channels;
+  std::vector<uint64_t> luma;
+};
+
+// The lock of one image's caches. A copied image starts with a lock of its
+// own, so copying one never ties it to the other.
+struct CacheMutex {
+  std::recursive_mutex mutex;
+
+  CacheMutex() {}
+  CacheMutex(const CacheMutex &) {}
+  CacheMutex &operator=(const CacheMutex &) { return *this; }
+};
+
+class Image {
+protected:
+  int width;
+  int height;
+  int max_luminocity = 255;
+
+  // Analytics built on first use and dropped by every operator that changes
+  // pixels, so repeated queries on an unchanged image are O(1).
+  mutable std::vector<std::shared_ptr<const SummedAreaTable>> summedAreaTables;
+  mutable std::vector<std::shared_ptr<const BlockExtremes>> blockExtremes;
+  mutable std::shared_ptr<ImageHistogram> histogram;
+
+  // Commands that only read an image may run concurrently (see
+  // executeCommand), so the lazy fills above are serialized. Per image, so
+  // queries on other tokens never wait for them. Recursive because some
+  // fills are built from other cached results.
+  mutable CacheMutex caches;
+
+  std::recursive_mutex &cacheMutex() const { return caches.mutex; }
+
+  ImageHistogram &cachedHistogram() const {
+    if (!histogram) {
+      histogram = std::make_shared<ImageHistogram>();
+    }
+    histogram->channels.resize(getChannels());
+    return *histogram;
+  }
+
+  // Records histograms counted as a side effect of a conversion pass.
+  void adoptHistogram(std::vector<std::vector<uint64_t>> channels,
+                      std::vector<uint64_t> luma) {
+    histogram = std::make_shared<ImageHistogram>();
+    histogram->channels = std::move(channels);
+    histogram->luma = std::move(luma);
+  }
+
+  // Same pixels as `other`: share its immutable tables and copy its bins.
+  // Locked, since `other` may be a shared image that a reader is filling.
+  void copyCaches(const Image &other) {
+    std::lock_guard<std::recursive_mutex> lock(other.cacheMutex());
+    summedAreaTables = other.summedAreaTables;
+    blockExtremes = other.blockExtremes;
+    histogram = other.histogram
+                    ? std::make_shared<ImageHistogram>(*other.histogram)
+                    : nullptr;
+  }
+
+  // For pixels that were moved but not changed (mirror, rotation).
+  void invalidateSpatialCaches() {
+    summedAreaTables.clear();
+    blockExtremes.clear();
+  }
+
+  // Every value v became max(maxValue - v, 0).
+  void reverseHistogram(int maxValue) {
+    invalidateSpatialCaches();
+    if (!histogram) {
+      return;
+    }
+    for (std::vector<uint64_t> &counts : histogram->channels) {
+      if (counts.empty()) {
+        continue;
+      }
+      std::vector<uint64_t> reversed(counts.size(), 0);
+      for (int v = 0; v < static_cast<int>(counts.size()); v++) {
+        reversed[std::max(maxValue - v, 0)] += counts[v];
+      }
+      counts = reversed;
+    }
+    histogram->luma.clear();
+  }
+
+  // Every value v of `channel` became map[v], map holding one entry per bin.
+  void remapHistogram(int channel, const int *map) {
+    invalidateSpatialCaches();
+    if (!histogram || histogram->channels[channel].empty()) {
+      histogram.reset();
+      return;
+    }
+    std::vector<uint64_t> &counts = histogram->channels[channel];
+    std::vector<uint64_t> remapped(counts.size(), 0);
+    for (int v = 0; v < static_cast<int>(counts.size()); v++) {
+      remapped[map[v]] += counts[v];
+    }
+    counts = remapped;
+    histogram->luma.clear();
+  }
+
+  // Full pass for the luma histogram, used when nothing cheaper is known.
+  virtual std::vector<uint64_t> countLumaHistogram() const = 0;
+
+public:
+  virtual ~Image() {}
+  int getWidth() const { return width; }
+  int getHeight() const { return height; }
+  int getMaxLuminocity() const { return max_luminocity; }
+  void setWidth(int width) { this->width = width; }
+  void setHeight(int height) { this->height = height; }
+  void setMaxLuminocity(int lum) { this->max_luminocity = lum; }
+
+  // Images whose maxval is above 255 keep 16-bit samples and go through the
+  // WidePlane kernels. Their histograms have maxval + 1 bins instead of 256.
+  bool isWide() const { return max_luminocity > 255; }
+  int getSampleMaximum() const { return isWide() ? max_luminocity : 255; }
+  int getHistogramBins() const { return getSampleMaximum() + 1; }
+
+  virtual Image &operator+=(int times) = 0;
+  virtual Image &operator*=(double factor) = 0;
+  virtual Image &operator!() = 0;
+  virtual Image &operator~() = 0;
+  virtual Image &operator*() = 0;
+  virtual Pixel &getPixel(int row, int col) const = 0;
+
+  // One sample of `channel`, in that channel's own (possibly subsampled)
+  // coordinates.
+  virtual int getSample(int channel, int row, int col) const = 0;
+
+  // Channel-wise access for the plane kernels. setChannel() replaces one
+  // channel with a plane of the same size; setChannels() replaces the whole
+  // pixel grid and takes its size from the first plane.
+  virtual int getChannels() const = 0;
+  virtual Plane getChannel(int channel) const = 0;
+  virtual void setChannel(int channel, const Plane &plane) = 0;
+  virtual void setChannels(const std::vector<Plane> &planes) = 0;
+  virtual WidePlane getWideChannel(int channel) const = 0;
+  virtual void setWideChannel(int channel, const WidePlane &plane) = 0;
+  virtual void setWideChannels(const std::vector<WidePlane> &planes) = 0;
+
+  // How many image pixels one sample of `channel` covers in each direction.
+  // Only the chroma planes of subsampled YUV images differ from 1.
+  virtual void getChannelSubsampling(int channel, int &factorX,
+                                     int &factorY) const {
+    factorX = 1;
+    factorY = 1;
+  }
+
+  void invalidateCaches() {
+    invalidateSpatialCaches();
+    histogram.reset();
+  }
+
+  const std::vector<uint64_t> &getChannelHistogram(int channel) const {
+    std::lock_guard<std::recursive_mutex> lock(cacheMutex());
+    ImageHistogram &cache = cachedHistogram();
+    if (cache.channels[channel].empty()) {
+      cache.channels[channel] =
+          isWide() ? countPlane(getWideChannel(channel), getHistogramBins())
+                   : countPlane(getChannel(channel));
+    }
+    return cache.channels[channel];
+  }
+
+  const std::vector<uint64_t> &getLumaHistogram() const {
+    std::lock_guard<std::recursive_mutex> lock(cacheMutex());
+    ImageHistogram &cache = cachedHistogram();
+    if (cache.luma.empty()) {
+      cache.luma = countLumaHistogram();
+    }
+    return cache.luma;
+  }
+
+  bool hasLumaHistogram() const { return histogram && !histogram->luma.empty(); }
+
+  const SummedAreaTable &getSummedAreaTable(int channel) const {
+    std::lock_guard<std::recursive_mutex> lock(cacheMutex());
+    summedAreaTables.resize(getChannels());
+    if (!summedAreaTables[channel]) {
+      summedAreaTables[channel] =
+          isWide() ? std::make_shared<SummedAreaTable>(getWideChannel(channel))
+                   : std::make_shared<SummedAreaTable>(getChannel(channel));
+    }
+    return *summedAreaTables[channel];
+  }
+
+  // Statistics of the rectangle (x, y, w, h) in image coordinates. On a
+  // subsampled channel the rectangle is widened to whole samples.
+  RegionStatistics getRegionStatistics(int channel, int x, int y, int w,
+                                       int h) const {
+    if (x == 0 && y == 0 && w == width && h == height) {
+      return histogramStatistics(getChannelHistogram(channel));
+    }
+
+    int factorX, factorY;
+    getChannelSubsampling(channel, factorX, factorY);
+    int left = x / factorX;
+    int top = y / factorY;
+    w = (x + w + factorX - 1) / factorX - left;
+    h = (y + h + factorY - 1) / factorY - top;
+
+    double count = static_cast<double>(w) * h;
+    RegionStatistics stats;
+
+    // Rectangles under 1/16 of the channel are read directly: building the
+    // tables would cost more than many such queries, and they hold several
+    // bytes per pixel for the lifetime of the image.
+    int channelWidth = (width + factorX - 1) / factorX;
+    int channelHeight = (height + factorY - 1) / factorY;
+    if (16 * count < static_cast<double>(channelWidth) * channelHeight) {
+      uint64_t sum = 0, squares = 0;
+      stats.minimum = 65535;
+      stats.maximum = 0;
+      for (int i = top; i < top + h; i++) {
+        for (int j = left; j < left + w; j++) {
+          uint64_t value = getSample(channel, i, j);
+          sum += value;
+          squares += value * value;
+          stats.minimum = std::min(stats.minimum, static_cast<int>(value));
+          stats.maximum = std::max(stats.maximum, static_cast<int>(value));
+        }
+      }
+      stats.mean = sum / count;
+      stats.variance = std::max(0.0, squares / count - stats.mean * stats.mean);
+      return stats;
+    }
+
+    const SummedAreaTable &table = getSummedAreaTable(channel);
+    stats.mean = table.sum(left, top, w, h) / count;
+    stats.variance = std::max(
+        0.0, table.sumOfSquares(left, top, w, h) / count - stats.mean * stats.mean);
+    std::shared_ptr<const BlockExtremes> extremes;
+    {
+      std::lock_guard<std::recursive_mutex> lock(cacheMutex());
+      blockExtremes.resize(getChannels());
+      if (!blockExtremes[channel]) {
+        blockExtremes[channel] =
+            isWide() ? std::make_shared<BlockExtremes>(getWideChannel(channel))
+                     : std::make_shared<BlockExtremes>(getChannel(channel));
+      }
+      extremes = blockExtremes[channel];
+    }
+    extremes->query(left, top, w, h, stats.minimum, stats.maximum);
+    return stats;
+  }
+
+  friend std::ostream &operator<<(std::ostream &out, Image &image);
+};
+
+class RGBImage : public Image {
+private:
+  RGBPixel **pixels;
+
+public:
+  RGBImage() {
+    width = 0;
+    height = 0;
+    max_luminocity = 255;
+    pixels = nullptr;
+  }
+
+  RGBImage(const RGBImage &img) {
+    width = img.width;
+    height = img.height;
+    max_luminocity = img.max_luminocity;
+    pixels = allocatePixels<RGBPixel>(width, height);
+    for (int i = 0; i < height; i++) {
+      for (int j = 0; j < width; j++) {
+        pixels[i][j] = img.pixels[i][j];
+      }
+    }
+    copyCaches(img);
+  }
+
+  RGBImage(std::istream &stream) {
+    stream.seekg(0);
+
+    std::string magicNumber;
+    stream >> magicNumber;
+    if (magicNumber != "P3") {
+      return;
+    }
+
+    stream >> width >> height >> max_luminocity;
+    max_luminocity = clampMaxval(max_luminocity);
+    pixels = allocatePixels<RGBPixel>(width, height);
+    for (int i = 0; i < height; i++) {
+      for (int j = 0; j < width; j++) {
+        int red, green, blue;
+        stream >> red >> green >> blue;
+        pixels[i][j] = RGBPixel(clampSample(red, max_luminocity),
+                                clampSample(green, max_luminocity),
+                                clampSample(blue, max_luminocity));
+      }
+    }
+  }
+
+  ~RGBImage() {
+    releasePixels(pixels);
+}
+
+  RGBImage(const YUVImage &yuvImage);
+  RGBImage(const GSCImage &yuvImage);
+
+  RGBImage &operator=(const RGBImage &img) {
+    if (this == &img) {
+      return *this;
+    }
+
+    releasePixels(pixels);
+
+    width = img.width;
+    height = img.height;
+    max_luminocity = img.max_luminocity;
+    pixels = allocatePixels<RGBPixel>(width, height);
+    for (int i = 0; i < height; i++) {
+      for (int j = 0; j < width; j++) {
+        pixels[i][j] = img.pixels[i][j];
+      }
+    }
+    copyCaches(img);
+
+    return *this;
+  }
+
+  virtual Image &operator+=(int times) override {
+    int turns = ((times % 4) + 4) % 4;
+    if (turns == 0) {
+      return *this;
+    }
+
+    RGBPixel **rotatedPixels = rotatePixels(pixels, width, height, turns);
+    if (!commitResult()) {
+      releasePixels(rotatedPixels);
+      return *this;
+    }
+    invalidateSpatialCaches();
+    releasePixels(pixels);
+    pixels = rotatedPixels;
+    if (turns != 2) {
+      std::swap(width, height);
+    }
+
+    return *this;
+  }
+
+  virtual Image &operator*=(double factor) override {
+    int newWidth = static_cast<int>(width * factor);
+    int newHeight = static_cast<int>(height * factor);
+
+    RGBPixel **resizedPixels = allocatePixels<RGBPixel>(newWidth, newHeight);
+    parallelFor(0, newHeight, [&](int first, int last) {
+      for (int i = first; i < last; i++) {
+        for (int j = 0; j < newWidth; j++) {
+          int r1 = std::min(static_cast<int>(std::floor(i / factor)), height - 1);
+          int r2 = std::min(static_cast<int>(std::ceil(i / factor)), height - 1);
+          int c1 = std::min(static_cast<int>(std::floor(j / factor)), width - 1);
+          int c2 = std::min(static_cast<int>(std::ceil(j / factor)), width - 1);
+
+          int redSum = pixels[r1][c1].getRed() + pixels[r1][c2].getRed() +
+                       pixels[r2][c1].getRed() + pixels[r2][c2].getRed();
+          int greenSum = pixels[r1][c1].getGreen() + pixels[r1][c2].getGreen() +
+                         pixels[r2][c1].getGreen() + pixels[r2][c2].getGreen();
+          int blueSum = pixels[r1][c1].getBlue() + pixels[r1][c2].getBlue() +
+                        pixels[r2][c1].getBlue() + pixels[r2][c2].getBlue();
+
+          int newRed = static_cast<int>(redSum / 4);
+          int newGreen = static_cast<int>(greenSum / 4);
+          int newBlue = static_cast<int>(blueSum / 4);
+
+          resizedPixels[i][j] = RGBPixel(newRed, newGreen, newBlue);
+        }
+      }
+    });
+    if (!commitResult()) {
+      releasePixels(resizedPixels);
+      return *this;
+    }
+
+    invalidateCaches();
+    releasePixels(pixels);
+
+    width = newWidth;
+    height = newHeight;
+    pixels = resizedPixels;
+
     return *this;
   }
 
-  virtual Pixel &getPixel(int row, int col) const override {
-    return pixels[row][col];
+  virtual Image &operator!() override {
+    bool done = parallelInvolution(height, [&](int first, int last) {
+      for (int i = first; i < last; i++) {
+        for (int j = 0; j < width; j++) {
+          pixels[i][j].setRed(std::max(max_luminocity - pixels[i][j].getRed(), 0));
+          pixels[i][j].setGreen(std::max(max_luminocity - pixels[i][j].getGreen(), 0));
+          pixels[i][j].setBlue(std::max(max_luminocity - pixels[i][j].getBlue(), 0));
+        }
+      }
+    });
+    if (done) {
+      reverseHistogram(max_luminocity);
+    }
+    return *this;
+  }
+
+  // Equalizes the luma without leaving RGB. 8-bit images get exactly what
+  // the 4:4:4 YUV round trip used to give, fused into one pass: each pixel's
+  // Y, U and V are computed, Y goes through the equalization map and the
+  // pixel is converted back, all in registers and without a YUV image. The
+  // luma histogram is the cached one, so an image fresh from a conversion is
+  // read only once. Like that round trip the result has a maxval of 255.
+  //
+  // Deeper images keep their depth: every pixel moves by the change of its
+  // luma, scaled as the YUV to RGB conversion would scale it, with one
+  // histogram bin per luma value.
+  virtual Image &operator~() override {
+    if (!isWide()) {
+      return equalizeLuma();
+    }
+
+    const int top = getSampleMaximum();
+    const std::vector<uint64_t> &lumaHistogram = getLumaHistogram();
+    const int bins = static_cast<int>(lumaHistogram.size());
+
+    // Calculate the shift of every luma value from its cumulative distribution
+    std::vector<int> shift(bins);
+    double cumulativeDistribution = 0.0;
+    for (int v = 0; v < bins; v++) {
+      cumulativeDistribution += static_cast<double>(lumaHistogram[v]) / (width * height);
+      int newLuminance = static_cast<int>(cumulativeDistribution * 235 * top / 255);
+      shift[v] = (298 * (newLuminance - v) + 128) >> 8;
+    }
+
+    RGBPixel **equalized = allocatePixels<RGBPixel>(width, height);
+    parallelFor(0, height, [&](int first, int last) {
+      for (int i = first; i < last; i++) {
+        for (int j = 0; j < width; j++) {
+          const RGBPixel &pixel = pixels[i][j];
+          int delta = shift[lumaOf(pixel.getRed(), pixel.getGreen(),
+                                   pixel.getBlue(), top)];
+          equalized[i][j] = RGBPixel(clampSample(pixel.getRed() + delta, top),
+                                     clampSample(pixel.getGreen() + delta, top),
+                                     clampSample(pixel.getBlue() + delta, top));
+        }
+      }
+    });
+    if (!commitResult()) {
+      releasePixels(equalized);
+      return *this;
+    }
+    invalidateCaches();
+    releasePixels(pixels);
+    pixels = equalized;
+
+    return *this;
+  }
+
+  virtual std::vector<uint64_t> countLumaHistogram() const override {
+    const int top = getSampleMaximum();
+    std::vector<uint64_t> counts(getHistogramBins(), 0);
+    for (int i = 0; i < height; i++) {
+      for (int j = 0; j < width; j++) {
+        counts[lumaOf(pixels[i][j].getRed(), pixels[i][j].getGreen(),
+                      pixels[i][j].getBlue(), top)]++;
+      }
+    }
+    return counts;
+  }
+
+  virtual Image &operator*() override {
+    bool done = parallelInvolution(height, [&](int first, int last) {
+      for (int i = first; i < last; i++) {
+        for (int j = 0; j < width / 2; j++) {
+          std::swap(pixels[i][j], pixels[i][width - j - 1]);
+        }
+      }
+    });
+    if (done) {
+      invalidateSpatialCaches();
+    }
+
+    return *this;
+  }
+
+  virtual Pixel &getPixel(int row, int col) const override {
+    return pixels[row][col];
+  }
+
+  virtual int getSample(int channel, int row, int col) const override {
+    const RGBPixel &pixel = pixels[row][col];
+    return channel == 0 ? pixel.getRed()
+                        : channel == 1 ? pixel.getGreen() : pixel.getBlue();
+  }
+
+  virtual int getChannels() const override { return 3; }
+
+  virtual Plane getChannel(int channel) const override {
+    return readChannel<unsigned char>(channel);
+  }
+
+  virtual WidePlane getWideChannel(int channel) const override {
+    return readChannel<uint16_t>(channel);
+  }
+
+  virtual void setChannel(int channel, const Plane &plane) override {
+    writeChannel(channel, plane);
+  }
+
+  virtual void setWideChannel(int channel, const WidePlane &plane) override {
+    writeChannel(channel, plane);
+  }
+
+  virtual void setChannels(const std::vector<Plane> &planes) override {
+    writeChannels(planes);
+  }
+
+  virtual void setWideChannels(const std::vector<WidePlane> &planes) override {
+    writeChannels(planes);
+  }
+
+private:
+  Image &equalizeLuma() {
+    int newLuminance[256];
+    lumaEqualizationMap(getLumaHistogram(), width, height, newLuminance);
+
+    std::vector<std::vector<uint64_t>> counts(3, std::vector<uint64_t>(256, 0));
+    std::vector<uint64_t> luma(256, 0);
+    std::mutex countsMutex;
+    RGBPixel **equalized = allocatePixels<RGBPixel>(width, height);
+    parallelFor(0, height, [&](int first, int last) {
+      std::vector<std::vector<uint64_t>> bandCounts(3, std::vector<uint64_t>(256, 0));
+      std::vector<uint64_t> bandLuma(256, 0);
+      for (int i = first; i < last; i++) {
+        for (int j = 0; j < width; j++) {
+          const RGBPixel &pixel = pixels[i][j];
+          int red = pixel.getRed();
+          int green = pixel.getGreen();
+          int blue = pixel.getBlue();
+          int y = newLuminance[lumaOf(red, green, blue)];
+          int u = ((-38 * red - 74 * green + 112 * blue + 128) >> 8) + 128;
+          int v = ((112 * red - 94 * green - 18 * blue + 128) >> 8) + 128;
+
+          red = std::min(std::max((298 * (y - 16) + 409 * (v - 128) + 128) >> 8, 0), 255);
+          green = std::min(std::max((298 * (y - 16) - 100 * (u - 128) - 208 * (v - 128) + 128) >> 8, 0), 255);
+          blue = std::min(std::max((298 * (y - 16) + 516 * (u - 128) + 128) >> 8, 0), 255);
+
+          equalized[i][j] = RGBPixel(static_cast<uint16_t>(red),
+                                     static_cast<uint16_t>(green),
+                                     static_cast<uint16_t>(blue));
+          bandCounts[0][red]++;
+          bandCounts[1][green]++;
+          bandCounts[2][blue]++;
+          bandLuma[lumaOf(red, green, blue)]++;
+        }
+      }
+      std::lock_guard<std::mutex> lock(countsMutex);
+      for (int v = 0; v < 256; v++) {
+        for (int c = 0; c < 3; c++) {
+          counts[c][v] += bandCounts[c][v];
+        }
+        luma[v] += bandLuma[v];
+      }
+    });
+    if (!commitResult()) {
+      releasePixels(equalized);
+      return *this;
+    }
+
+    releasePixels(pixels);
+    pixels = equalized;
+    max_luminocity = 255;
+    invalidateCaches();
+    adoptHistogram(std::move(counts), std::move(luma));
+    return *this;
+  }
+
+  template <typename T> BasicPlane<T> readChannel(int channel) const {
+    BasicPlane<T> plane(width, height);
+    for (int i = 0; i < height; i++) {
+      T *row = plane.row(i);
+      for (int j = 0; j < width; j++) {
+        if (channel == 0) {
+          row[j] = pixels[i][j].getRed();
+        } else if (channel == 1) {
+          row[j] = pixels[i][j].getGreen();
+        } else {
+          row[j] = pixels[i][j].getBlue();
+        }
+      }
+    }
+    return plane;
+  }
+
+  template <typename T>
+  void writeChannel(int channel, const BasicPlane<T> &plane) {
+    invalidateCaches();
+    for (int i = 0; i < height; i++) {
+      const T *row = plane.row(i);
+      for (int j = 0; j < width; j++) {
+        if (channel == 0) {
+          pixels[i][j].setRed(row[j]);
+        } else if (channel == 1) {
+          pixels[i][j].setGreen(row[j]);
+        } else {
+          pixels[i][j].setBlue(row[j]);
+        }
+      }
+    }
+  }
+
+  template <typename T>
+  void writeChannels(const std::vector<BasicPlane<T>> &planes) {
+    invalidateCaches();
+    releasePixels(pixels);
+
+    width = planes[0].getWidth();
+    height = planes[0].getHeight();
+    pixels = allocatePixels<RGBPixel>(width, height);
+    for (int i = 0; i < height; i++) {
+      const T *red = planes[0].row(i);
+      const T *green = planes[1].row(i);
+      const T *blue = planes[2].row(i);
+      for (int j = 0; j < width; j++) {
+        pixels[i][j] = RGBPixel(red[j], green[j], blue[j]);
+      }
+    }
+  }
+};
+
+enum class ChromaSubsampling { Yuv444, Yuv422, Yuv420 };
+
+bool parseChromaSubsampling(const std::string &name,
+                            ChromaSubsampling &subsampling) {
+  if (name == "444") {
+    subsampling = ChromaSubsampling::Yuv444;
+  } else if (name == "422") {
+    subsampling = ChromaSubsampling::Yuv422;
+  } else if (name == "420") {
+    subsampling = ChromaSubsampling::Yuv420;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+class YUVImage : public Image {
+private:
+  // Planar storage: a full-resolution Y plane followed by U and V planes
+  // holding one sample per chroma block (1x1, 2x1 or 2x2 pixels).
+  Plane planes[3];
+  ChromaSubsampling subsampling;
+  mutable YUVPixel sample;
+
+public:
+  YUVImage() {
+    width = 0;
+    height = 0;
+    max_luminocity = 235;
+    subsampling = ChromaSubsampling::Yuv444;
+  }
+
+  YUVImage(int width, int height, ChromaSubsampling subsampling) {
+    this->width = width;
+    this->height = height;
+    max_luminocity = 235;
+    this->subsampling = subsampling;
+    int factorX, factorY;
+    getChannelSubsampling(1, factorX, factorY);
+    planes[0] = Plane(width, height, 16);
+    planes[1] = Plane((width + factorX - 1) / factorX,
+                      (height + factorY - 1) / factorY, 128);
+    planes[2] = planes[1];
+  }
+
+  YUVImage(const YUVImage &img) {
+    width = img.width;
+    height = img.height;
+    max_luminocity = img.max_luminocity;
+    subsampling = img.subsampling;
+
+    for (int c = 0; c < 3; c++) {
+      planes[c] = img.planes[c];
+    }
+    copyCaches(img);
+  }
+
+  YUVImage(const RGBImage &rgbImage,
+           ChromaSubsampling subsampling = ChromaSubsampling::Yuv444) {
+    width = rgbImage.getWidth();
+    height = rgbImage.getHeight();
+    max_luminocity = 235;
+    this->subsampling = subsampling;
+    std::vector<std::vector<uint64_t>> counts(3, std::vector<uint64_t>(256, 0));
+
+    // YUV is 8-bit, so deeper samples are scaled down first
+    const int depth = rgbImage.getSampleMaximum();
+    auto narrow = [depth](int value) {
+      return depth == 255 ? value : (value * 255 + depth / 2) / depth;
+    };
+
+    // Chroma is computed at full resolution and box-filtered down afterwards
+    planes[0] = Plane(width, height);
+    planes[1] = Plane(width, height);
+    planes[2] = Plane(width, height);
+    for (int i = 0; i < height; i++) {
+      unsigned char *yRow = planes[0].row(i);
+      unsigned char *uRow = planes[1].row(i);
+      unsigned char *vRow = planes[2].row(i);
+      for (int j = 0; j < width; j++) {
+        const Pixel &pixel = rgbImage.getPixel(i, j);
+        const RGBPixel &rgbPixel = dynamic_cast<const RGBPixel &>(pixel);
+        int red = narrow(rgbPixel.getRed());
+        int green = narrow(rgbPixel.getGreen());
+        int blue = narrow(rgbPixel.getBlue());
+
+        int y1 = lumaOf(red, green, blue);
+        int u1 = static_cast<int>(((-38 * red - 74 * green + 112 * blue + 128) >> 8) + 128);
+        int v1 = static_cast<int>(((112 * red - 94 * green - 18 * blue + 128) >> 8) + 128);
+
+        yRow[j] = static_cast<unsigned char>(y1);
+        uRow[j] = static_cast<unsigned char>(u1);
+        vRow[j] = static_cast<unsigned char>(v1);
+        counts[0][yRow[j]]++;
+      }
+    }
+
+    int factorX, factorY;
+    getChannelSubsampling(1, factorX, factorY);
+    for (int c = 1; c < 3; c++) {
+      if (factorX > 1 || factorY > 1) {
+        planes[c] = downsampleChroma(planes[c], factorX, factorY);
+      }
+      counts[c] = countPlane(planes[c]);
+    }
+    std::vector<uint64_t> luma = counts[0];
+    adoptHistogram(std::move(counts), std::move(luma));
+  }
+
+  ChromaSubsampling getSubsampling() const { return subsampling; }
+
+  const Plane &getPlane(int channel) const { return planes[channel]; }
+
+  Plane &getPlane(int channel) { return planes[channel]; }
+
+  virtual Image &operator+=(int times) override {
+    int turns = ((times % 4) + 4) % 4;
+    if (turns == 0) {
+      return *this;
+    }
+    int factorX, factorY;
+    getChannelSubsampling(1, factorX, factorY);
+
+    // A quarter turn swaps the axes, so only square chroma blocks survive it
+    bool aligned = (turns % 2 == 0 || factorX == factorY) &&
+                   (turns == 3 || height % factorY == 0) &&
+                   (turns == 1 || width % factorX == 0);
+    Plane rotated[3];
+    for (int c = 1; c < 3; c++) {
+      rotated[c] = transformChroma(planes[c], width, height, factorX, factorY,
+                                   aligned, [&](const Plane &plane) {
+                                     return rotatePlane(plane, turns);
+                                   });
+    }
+    rotated[0] = rotatePlane(planes[0], turns);
+    if (!commitResult()) {
+      return *this;
+    }
+    invalidateSpatialCaches();
+    for (int c = 0; c < 3; c++) {
+      planes[c] = std::move(rotated[c]);
+    }
+    width = planes[0].getWidth();
+    height = planes[0].getHeight();
+
+    return *this;
+  }
+
+  virtual Image &operator*=(double factor) override {
+    int newWidth = static_cast<int>(width * factor);
+    int newHeight = static_cast<int>(height * factor);
+    int factorX, factorY;
+    getChannelSubsampling(1, factorX, factorY);
+
+    Plane scaled[3];
+    scaled[0] = scalePlane(planes[0], newWidth, newHeight, factor, factor);
+    for (int c = 1; c < 3; c++) {
+      scaled[c] = scalePlane(planes[c], (newWidth + factorX - 1) / factorX,
+                             (newHeight + factorY - 1) / factorY, factor,
+                             factor);
+    }
+    if (!commitResult()) {
+      return *this;
+    }
+    invalidateCaches();
+    for (int c = 0; c < 3; c++) {
+      planes[c] = std::move(scaled[c]);
+    }
+    width = newWidth;
+    height = newHeight;
+
+    return *this;
+  }
+
+  // The YUV counterpart of negating R, G and B: luma is reflected inside
+  // [16, 235] and chroma around 128.
+  virtual Image &operator!() override {
+    int maps[3][256];
+    for (int v = 0; v < 256; v++) {
+      maps[0][v] = std::max(16 + max_luminocity - v, 0);
+      maps[1][v] = maps[2][v] = std::min(256 - v, 255);
+    }
+    Plane negated[3];
+    for (int c = 0; c < 3; c++) {
+      const Plane &plane = planes[c];
+      const int *map = maps[c];
+      negated[c] = Plane(plane.getWidth(), plane.getHeight());
+      parallelFor(0, plane.getHeight(), [&](int first, int last) {
+        for (int i = first; i < last; i++) {
+          const unsigned char *row = plane.row(i);
+          unsigned char *out = negated[c].row(i);
+          for (int j = 0; j < plane.getWidth(); j++) {
+            out[j] = static_cast<unsigned char>(map[row[j]]);
+          }
+        }
+      });
+    }
+    if (!commitResult()) {
+      return *this;
+    }
+    for (int c = 0; c < 3; c++) {
+      planes[c] = std::move(negated[c]);
+      remapHistogram(c, maps[c]);
+    }
+    return *this;
+  }
+
+  // Equalizes the Y plane only; chroma is not touched.
+  virtual Image &operator~() override {
+    // Cached when the image came from a conversion, counted otherwise
+    int newLuminance[256];
+    lumaEqualizationMap(getChannelHistogram(0), width, height, newLuminance);
+
+    // Apply luminance transformation to the image
+    Plane equalized(width, height);
+    parallelFor(0, height, [&](int first, int last) {
+      for (int i = first; i < last; i++) {
+        const unsigned char *row = planes[0].row(i);
+        unsigned char *out = equalized.row(i);
+        for (int j = 0; j < width; j++) {
+          out[j] = static_cast<unsigned char>(newLuminance[row[j]]);
+        }
+      }
+    });
+    if (!commitResult()) {
+      return *this;
+    }
+    planes[0] = std::move(equalized);
+    remapHistogram(0, newLuminance);
+
+    return *this;
+  }
+
+  virtual Image &operator*() override {
+    int factorX, factorY;
+    getChannelSubsampling(1, factorX, factorY);
+    Plane mirrored[3];
+    for (int c = 1; c < 3; c++) {
+      mirrored[c] = transformChroma(planes[c], width, height, factorX, factorY,
+                                    width % factorX == 0, mirrorPlane);
+    }
+    mirrored[0] = mirrorPlane(planes[0]);
+    if (!commitResult()) {
+      return *this;
+    }
+    invalidateSpatialCaches();
+    for (int c = 0; c < 3; c++) {
+      planes[c] = std::move(mirrored[c]);
+    }
+
+    return *this;
+  }
+
+  virtual std::vector<uint64_t> countLumaHistogram() const override {
+    return getChannelHistogram(0);
+  }
+
+  // Planar storage has no YUVPixel objects, so this returns a snapshot of
+  // the pixel (with the chroma of its block) that is overwritten by the next
+  // call. Writes through it do not reach the image.
+  virtual Pixel &getPixel(int row, int col) const override {
+    int factorX, factorY;
+    getChannelSubsampling(1, factorX, factorY);
+    sample = YUVPixel(planes[0].row(row)[col],
+                      planes[1].row(row / factorY)[col / factorX],
+                      planes[2].row(row / factorY)[col / factorX]);
+    return sample;
+  }
+
+  virtual int getSample(int channel, int row, int col) const override {
+    return planes[channel].row(row)[col];
+  }
+
+  virtual int getChannels() const override { return 3; }
+
+  virtual void getChannelSubsampling(int channel, int &factorX,
+                                     int &factorY) const override {
+    factorX = channel > 0 && subsampling != ChromaSubsampling::Yuv444 ? 2 : 1;
+    factorY = channel > 0 && subsampling == ChromaSubsampling::Yuv420 ? 2 : 1;
+  }
+
+  virtual Plane getChannel(int channel) const override {
+    return planes[channel];
+  }
+
+  virtual void setChannel(int channel, const Plane &plane) override {
+    invalidateCaches();
+    planes[channel] = plane;
+  }
+
+  virtual void setChannels(const std::vector<Plane> &planes) override {
+    invalidateCaches();
+    width = planes[0].getWidth();
+    height = planes[0].getHeight();
+    for (int c = 0; c < 3; c++) {
+      this->planes[c] = planes[c];
+    }
+  }
+
+  // YUV is always 8-bit; the wide accessors only convert.
+  virtual WidePlane getWideChannel(int channel) const override {
+    return convertPlane<uint16_t>(planes[channel]);
+  }
+
+  virtual void setWideChannel(int channel, const WidePlane &plane) override {
+    setChannel(channel, convertPlane<unsigned char>(plane));
+  }
+
+  virtual void setWideChannels(const std::vector<WidePlane> &planes) override {
+    std::vector<Plane> narrow;
+    for (const WidePlane &plane : planes) {
+      narrow.push_back(convertPlane<unsigned char>(plane));
+    }
+    setChannels(narrow);
+  }
+};
+
+RGBImage::RGBImage(const YUVImage &yuvImage) {
+  width = yuvImage.getWidth();
+  height = yuvImage.getHeight();
+  max_luminocity = 255;
+  std::vector<std::vector<uint64_t>> counts(3, std::vector<uint64_t>(256, 0));
+  std::vector<uint64_t> luma(256, 0);
+
+  // Subsampled chroma is interpolated back to full resolution first
+  int factorX, factorY;
+  yuvImage.getChannelSubsampling(1, factorX, factorY);
+  Plane upsampledU, upsampledV;
+  if (factorX > 1 || factorY > 1) {
+    upsampledU = upsampleChroma(yuvImage.getPlane(1), width, height, factorX, factorY);
+    upsampledV = upsampleChroma(yuvImage.getPlane(2), width, height, factorX, factorY);
+  }
+  const Plane &planeY = yuvImage.getPlane(0);
+  const Plane &planeU = factorX > 1 || factorY > 1 ? upsampledU : yuvImage.getPlane(1);
+  const Plane &planeV = factorX > 1 || factorY > 1 ? upsampledV : yuvImage.getPlane(2);
+
+  pixels = allocatePixels<RGBPixel>(width, height);
+  for (int i = 0; i < height; i++) {
+    for (int j = 0; j < width; j++) {
+      int y = static_cast<int>(planeY.row(i)[j]);
+      int u = static_cast<int>(planeU.row(i)[j]);
+      int v = static_cast<int>(planeV.row(i)[j]);
+
+      int red1 = ((298 * (y - 16) + 409 * (v - 128) + 128) >> 8);
+      int green1 = ((298 * (y - 16) - 100 * (u - 128) - 208 * (v - 128) + 128) >> 8);
+      int blue1 = ((298 * (y - 16) + 516 * (u - 128) + 128) >> 8);
+      
+      if (red1 < 0) {
+        red1 = 0;
+	  }
+      else if (red1 > 255) {
+        red1 = 255;
+	  }
+
+      if (green1 < 0) {
+        green1 = 0;
+	  }
+      else if (green1 > 255) {
+        green1 = 255;
+	  }
+
+      if (blue1 < 0) {
+        blue1 = 0;
+	  }
+      else if (blue1 > 255) {
+        blue1 = 255;
+	  }
+
+      unsigned char red = static_cast<unsigned char>(red1);
+      unsigned char green = static_cast<unsigned char>(green1);
+      unsigned char blue = static_cast<unsigned char>(blue1);
+
+      pixels[i][j] = RGBPixel(red, green, blue);
+      counts[0][red]++;
+      counts[1][green]++;
+      counts[2][blue]++;
+      luma[lumaOf(red, green, blue)]++;
+    }
+  }
+  adoptHistogram(std::move(counts), std::move(luma));
+
+  delete &yuvImage;
+}
+
+class GSCImage : public Image {
+private:
+  GSCPixel **pixels;
+
+public:
+  GSCImage() {
+    width = 0;
+    height = 0;
+    max_luminocity = 255;
+    pixels = nullptr;
+  }
+
+  GSCImage(const GSCImage &img) {
+    width = img.width;
+    height = img.height;
+    max_luminocity = img.max_luminocity;
+
+    pixels = allocatePixels<GSCPixel>(width, height);
+    for (int i = 0; i < height; i++) {
+      for (int j = 0; j < width; j++) {
+        pixels[i][j] = img.pixels[i][j];
+      }
+    }
+    copyCaches(img);
+  }
+
+  GSCImage(const RGBImage &grayscaled) {
+    width = grayscaled.getWidth();
+    height = grayscaled.getHeight();
+    max_luminocity = grayscaled.getMaxLuminocity();
+    std::vector<uint64_t> counts(getHistogramBins(), 0);
+
+    pixels = allocatePixels<GSCPixel>(width, height);
+    for (int i = 0; i < height; i++) {
+      for (int j = 0; j < width; j++) {
+        const Pixel &pixel = grayscaled.getPixel(i, j);
+        const RGBPixel &rgbPixel = dynamic_cast<const RGBPixel &>(pixel);
+        uint16_t grayValue = static_cast<uint16_t>(rgbPixel.getRed() * 0.3 + rgbPixel.getGreen() * 0.59 + rgbPixel.getBlue() * 0.11);
+        pixels[i][j] = GSCPixel(grayValue);
+        counts[grayValue]++;
+      }
+    }
+    adoptHistogram({counts}, {});
+  }
+
+  GSCImage(const RGBImage &grayscaled, int dontMind) {
+    width = grayscaled.getWidth();
+    height = grayscaled.getHeight();
+    max_luminocity = grayscaled.getMaxLuminocity();
+    std::vector<uint64_t> counts(getHistogramBins(), 0);
+
+    pixels = allocatePixels<GSCPixel>(width, height);
+    for (int i = 0; i < height; i++) {
+      for (int j = 0; j < width; j++) {
+        const Pixel &pixel = grayscaled.getPixel(i, j);
+        const RGBPixel &rgbPixel = dynamic_cast<const RGBPixel &>(pixel);
+        uint16_t grayValue = static_cast<uint16_t>(rgbPixel.getRed());
+        pixels[i][j] = GSCPixel(grayValue);
+        counts[grayValue]++;
+      }
+    }
+    adoptHistogram({counts}, {});
+  }
+
+  GSCImage(std::istream &stream) {
+    stream.seekg(0);
+
+    std::string magicNumber;
+    stream >> magicNumber;
+    if (magicNumber != "P2") {
+      return;
+    }
+
+    stream >> width >> height >> max_luminocity;
+    max_luminocity = clampMaxval(max_luminocity);
+
+    pixels = allocatePixels<GSCPixel>(width, height);
+    for (int i = 0; i < height; i++) {
+      for (int j = 0; j < width; j++) {
+        int pixelValue;
+        stream >> pixelValue;
+        pixels[i][j] = GSCPixel(clampSample(pixelValue, max_luminocity));
+      }
+    }
+  }
+
+~GSCImage() {
+    releasePixels(pixels);
+}
+
+  GSCImage &operator=(const GSCImage &img) {
+    if (this != &img) {
+      releasePixels(pixels);
+
+      width = img.width;
+      height = img.height;
+      max_luminocity = img.max_luminocity;
+
+      pixels = allocatePixels<GSCPixel>(width, height);
+      for (int i = 0; i < height; i++) {
+        for (int j = 0; j < width; j++) {
+          pixels[i][j] = img.pixels[i][j];
+        }
+      }
+      copyCaches(img);
+    }
+    return *this;
+  }
+
+  virtual Image &operator+=(int times) override {
+    int turns = ((times % 4) + 4) % 4;
+    if (turns == 0) {
+      return *this;
+    }
+
+    GSCPixel **rotatedPixels = rotatePixels(pixels, width, height, turns);
+    if (!commitResult()) {
+      releasePixels(rotatedPixels);
+      return *this;
+    }
+    invalidateSpatialCaches();
+    releasePixels(pixels);
+    pixels = rotatedPixels;
+    if (turns != 2) {
+      std::swap(width, height);
+    }
+
+    return *this;
+  }
+
+  virtual Image &operator*=(double factor) override {
+    int newWidth = static_cast<int>(width * factor);
+    int newHeight = static_cast<int>(height * factor);
+
+    GSCPixel **resizedPixels = allocatePixels<GSCPixel>(newWidth, newHeight);
+    parallelFor(0, newHeight, [&](int first, int last) {
+      for (int i = first; i < last; i++) {
+        for (int j = 0; j < newWidth; j++) {
+          int r1 = std::min(static_cast<int>(std::floor(i / factor)), height - 1);
+          int r2 = std::min(static_cast<int>(std::ceil(i / factor)), height - 1);
+          int c1 = std::min(static_cast<int>(std::floor(j / factor)), width - 1);
+          int c2 = std::min(static_cast<int>(std::ceil(j / factor)), width - 1);
+
+          int value = static_cast<int>((pixels[r1][c1].getValue() + pixels[r1][c2].getValue() +
+                       pixels[r2][c1].getValue() + pixels[r2][c2].getValue())/4);
+
+          resizedPixels[i][j] = GSCPixel(static_cast<uint16_t>(value));
+        }
+      }
+    });
+    if (!commitResult()) {
+      releasePixels(resizedPixels);
+      return *this;
+    }
+
+    invalidateCaches();
+    releasePixels(pixels);
+
+    width = newWidth;
+    height = newHeight;
+    pixels = resizedPixels;
+
+    return *this;
+  }
+
+  virtual Image &operator!() override {
+    bool done = parallelInvolution(height, [&](int first, int last) {
+      for (int i = first; i < last; i++) {
+        for (int j = 0; j < width; j++) {
+          int value = pixels[i][j].getValue();
+          pixels[i][j].setValue(std::max(max_luminocity - value, 0));
+        }
+      }
+    });
+    if (done) {
+      reverseHistogram(max_luminocity);
+    }
+    return *this;
+  }
+
+  virtual Image &operator~() override {
+    // Cached histogram, counted only if unknown
+    // One bin per possible value: 256, or maxval + 1 for 16-bit images
+    const std::vector<uint64_t> &valueHistogram = getChannelHistogram(0);
+    const int bins = getHistogramBins();
+
+    // Calculate probability distribution
+    std::vector<double> probabilityDistribution(bins);
+    for (int i = 0; i < bins; i++) {
+      probabilityDistribution[i] = static_cast<double>(valueHistogram[i]) / (width * height);
+    }
+
+    // Calculate cumulative probability distribution
+    std::vector<double> cumulativeDistribution(bins);
+    cumulativeDistribution[0] = probabilityDistribution[0];
+    for (int i = 1; i < bins; i++) {
+      cumulativeDistribution[i] = cumulativeDistribution[i - 1] + probabilityDistribution[i];
+    }
+
+    // Calculate new luminance values
+    std::vector<int> newLuminance(bins);
+    for (int i = 0; i < bins; i++) {
+      newLuminance[i] = static_cast<int>(cumulativeDistribution[i] * (bins - 1));
+    }
+
+    // Apply luminance transformation to the image
+    GSCPixel **equalized = allocatePixels<GSCPixel>(width, height);
+    parallelFor(0, height, [&](int first, int last) {
+      for (int i = first; i < last; i++) {
+        for (int j = 0; j < width; j++) {
+          int currentLuminance = pixels[i][j].getValue();
+
+          uint16_t newPixelValue =  static_cast<uint16_t>(newLuminance[currentLuminance]);
+          equalized[i][j] = GSCPixel(newPixelValue);
+        }
+      }
+    });
+    if (!commitResult()) {
+      releasePixels(equalized);
+      return *this;
+    }
+    releasePixels(pixels);
+    pixels = equalized;
+    remapHistogram(0, newLuminance.data());
+
+    return *this;
+  }
+
+  virtual std::vector<uint64_t> countLumaHistogram() const override {
+    const std::vector<uint64_t> &counts = getChannelHistogram(0);
+    const int top = getSampleMaximum();
+    std::vector<uint64_t> luma(counts.size(), 0);
+    for (int v = 0; v < static_cast<int>(counts.size()); v++) {
+      luma[lumaOf(v, v, v, top)] += counts[v];
+    }
+    return luma;
+  }
+
+  virtual Image &operator*() override {
+    bool done = parallelInvolution(height, [&](int first, int last) {
+      for (int i = first; i < last; i++) {
+        for (int j = 0; j < width / 2; j++) {
+          std::swap(pixels[i][j], pixels[i][width - j - 1]);
+        }
+      }
+    });
+    if (done) {
+      invalidateSpatialCaches();
+    }
+    return *this;
+  }
+
+  virtual Pixel &getPixel(int row, int col) const override {
+    return pixels[row][col];
+  }
+
+  virtual int getSample(int channel, int row, int col) const override {
+    return pixels[row][col].getValue();
+  }
+
+  virtual int getChannels() const override { return 1; }
+
+  virtual Plane getChannel(int channel) const override {
+    return readChannel<unsigned char>();
+  }
+
+  virtual WidePlane getWideChannel(int channel) const override {
+    return readChannel<uint16_t>();
+  }
+
+  virtual void setChannel(int channel, const Plane &plane) override {
+    writeChannel(plane);
+  }
+
+  virtual void setWideChannel(int channel, const WidePlane &plane) override {
+    writeChannel(plane);
+  }
+
+  virtual void setChannels(const std::vector<Plane> &planes) override {
+    writeChannels(planes);
+  }
+
+  virtual void setWideChannels(const std::vector<WidePlane> &planes) override {
+    writeChannels(planes);
+  }
+
+private:
+  template <typename T> BasicPlane<T> readChannel() const {
+    BasicPlane<T> plane(width, height);
+    for (int i = 0; i < height; i++) {
+      T *row = plane.row(i);
+      for (int j = 0; j < width; j++) {
+        row[j] = pixels[i][j].getValue();
+      }
+    }
+    return plane;
+  }
+
+  template <typename T> void writeChannel(const BasicPlane<T> &plane) {
+    invalidateCaches();
+    for (int i = 0; i < height; i++) {
+      const T *row = plane.row(i);
+      for (int j = 0; j < width; j++) {
+        pixels[i][j].setValue(row[j]);
+      }
+    }
+  }
+
+  template <typename T>
+  void writeChannels(const std::vector<BasicPlane<T>> &planes) {
+    invalidateCaches();
+    releasePixels(pixels);
+
+    width = planes[0].getWidth();
+    height = planes[0].getHeight();
+    pixels = allocatePixels<GSCPixel>(width, height);
+    for (int i = 0; i < height; i++) {
+      const T *value = planes[0].row(i);
+      for (int j = 0; j < width; j++) {
+        pixels[i][j] = GSCPixel(value[j]);
+      }
+    }
+  }
+};
+
+RGBImage::RGBImage(const GSCImage &gscImage) {
+  width = gscImage.getWidth();
+  height = gscImage.getHeight();
+  max_luminocity = gscImage.getMaxLuminocity();
+  std::vector<uint64_t> counts(getHistogramBins(), 0);
+
+  pixels = allocatePixels<RGBPixel>(width, height);
+  for (int i = 0; i < height; i++) {
+    for (int j = 0; j < width; j++) {
+      const Pixel &pixel = gscImage.getPixel(i, j);
+      const GSCPixel &gscPixel = dynamic_cast<const GSCPixel &>(pixel);
+
+      int value = static_cast<int>(gscPixel.getValue());
+		
+      uint16_t red = static_cast<uint16_t>(value);
+      uint16_t green = static_cast<uint16_t>(value);
+      uint16_t blue = static_cast<uint16_t>(value);
+
+      pixels[i][j] = RGBPixel(red, green, blue);
+      counts[value]++;
+    }
+  }
+  std::vector<uint64_t> luma(counts.size(), 0);
+  for (int v = 0; v < static_cast<int>(counts.size()); v++) {
+    luma[lumaOf(v, v, v, getSampleMaximum())] += counts[v];
+  }
+  adoptHistogram({counts, counts, counts}, std::move(luma));
+
+  delete &gscImage;
+}
+
+std::ostream &operator<<(std::ostream &out, Image &image) {
+  out << "P2" << std::endl;
+  out << image.getWidth() << " " << image.getHeight() << std::endl;
+  out << image.getMaxLuminocity() << std::endl;
+  for (int i = 0; i < image.getHeight(); i++) {
+    for (int j = 0; j < image.getWidth(); j++) {
+      out << static_cast<int>(
+                 static_cast<GSCPixel &>(image.getPixel(i, j)).getValue())
+          << " ";
+    }
+    out << std::endl;
+  }
+  return out;
+}
+
+Image *cloneImage(const Image *image) {
+  if (const RGBImage *rgbImage = dynamic_cast<const RGBImage *>(image)) {
+    return new RGBImage(*rgbImage);
+  }
+  if (const GSCImage *gscImage = dynamic_cast<const GSCImage *>(image)) {
+    return new GSCImage(*gscImage);
+  }
+  return new YUVImage(*static_cast<const YUVImage *>(image));
+}
+
+// Replaces every channel of `image` with resize(channel, width, height),
+// width x height being the channel's size in a newWidth x newHeight image.
+template <typename Resize>
+void resizeChannels(Image &image, int newWidth, int newHeight, Resize resize) {
+  std::vector<Plane> planes;
+  std::vector<WidePlane> widePlanes;
+  for (int c = 0; c < image.getChannels(); c++) {
+    int factorX, factorY;
+    image.getChannelSubsampling(c, factorX, factorY);
+    int width = (newWidth + factorX - 1) / factorX;
+    int height = (newHeight + factorY - 1) / factorY;
+    if (image.isWide()) {
+      widePlanes.push_back(resize(image.getWideChannel(c), width, height));
+    } else {
+      planes.push_back(resize(image.getChannel(c), width, height));
+    }
+  }
+  if (image.isWide()) {
+    image.setWideChannels(widePlanes);
+  } else {
+    image.setChannels(planes);
+  }
+}
+
+// For inputs readNetpbmTextShrunk() does not handle: shrinks a decoded image
+// the same way.
+void shrinkImage(Image &image, const ShrinkTarget &target) {
+  int newWidth, newHeight;
+  target.apply(image.getWidth(), image.getHeight(), newWidth, newHeight);
+  resizeChannels(image, newWidth, newHeight,
+                 [](const auto &plane, int width, int height) {
+                   return shrinkPlane(plane, width, height);
+                 });
+}
+
+// Halvings of one image, built as `s` asks for them once `pyramid` is on.
+// Scaling from the smallest level at least as large as the result, rather
+// than from the token's current image, keeps repeated scaling from
+// compounding the error of each step, and every level is within 2x of the
+// result, so the cost follows the output size.
+class ImagePyramid {
+private:
+  std::vector<std::unique_ptr<Image>> levels;
+
+public:
+  void reset() { levels.clear(); }
+
+  // A new image of width x height resampled from the level nearest above
+  // it; `image` becomes level 0 when the pyramid is empty.
+  Image *scale(const Image &image, int width, int height) {
+    if (levels.empty()) {
+      levels.emplace_back(cloneImage(&image));
+    }
+    ShrinkTarget half;
+    half.scale = 0.5;
+    for (;;) {
+      const Image &last = *levels.back();
+      int halfWidth, halfHeight;
+      half.apply(last.getWidth(), last.getHeight(), halfWidth, halfHeight);
+      if (halfWidth < width || halfHeight < height ||
+          (halfWidth == last.getWidth() && halfHeight == last.getHeight())) {
+        break;
+      }
+      levels.emplace_back(cloneImage(&last));
+      shrinkImage(*levels.back(), half);
+    }
+
+    size_t level = levels.size() - 1;
+    while (level > 0 && (levels[level]->getWidth() < width ||
+                         levels[level]->getHeight() < height)) {
+      level--;
+    }
+    const Image &source = *levels[level];
+    Image *scaled = cloneImage(&source);
+    resizeChannels(*scaled, width, height,
+                   [](const auto &plane, int w, int h) {
+                     return scalePlane(plane, w, h,
+                                       static_cast<double>(w) / plane.getWidth(),
+                                       static_cast<double>(h) / plane.getHeight());
+                   });
+    return scaled;
+  }
+};
+
+enum class ImageKind { Grayscale, RGB, YUV };
+
+// An import whose decoding is put off because the result cache may make it
+// unnecessary. `operations` are the commands applied since, replayed when
+// the image is needed, and `kind` is what the image will be after them.
+struct DeferredImport {
+  std::string filename;
+  std::string source;
+  ImageKind kind;
+  std::vector<std::vector<std::string>> operations;
+  ShrinkTarget shrink = ShrinkTarget();
+};
+
+class Token {
+private:
+  std::string name;
+  Image *ptr;
+  // Held shared by commands that only read the image and exclusively by
+  // the rest. Shared so that copies of the token keep the same lock.
+  std::shared_ptr<std::shared_mutex> lock;
+  // Set while ptr is also used by other tokens (imports of the same file);
+  // the image is then copied before it is first changed.
+  std::shared_ptr<Image> shared;
+  // Content hash of the imported file followed by every command applied
+  // since, one per line. Empty when the origin is not known.
+  std::string history;
+  std::shared_ptr<DeferredImport> deferred;
+  // Set by `pyramid on`; shared between copies of the token.
+  std::shared_ptr<ImagePyramid> pyramid;
+
+public:
+  Token(const std::string &n = "", Image *p = nullptr)
+      : name(n), ptr(p), lock(std::make_shared<std::shared_mutex>()) {}
+  std::string getName() const { return name; }
+  Image *getPtr() const { return ptr; }
+  void setName(const std::string &n) { name = n; }
+  void setPtr(Image *p) { ptr = p; }
+  std::shared_mutex &getLock() const { return *lock; }
+
+  const std::string &getHistory() const { return history; }
+  void setHistory(const std::string &h) { history = h; }
+
+  // Commands are recorded without the token name, so the history only
+  // depends on what was done to the image.
+  void recordOperation(const std::vector<std::string> &tokens) {
+    if (history.empty()) {
+      return;
+    }
+    history += "\n" + tokens[0];
+    for (size_t k = 2; k < tokens.size(); k++) {
+      history += " " + tokens[k];
+    }
+  }
+
+  bool isDeferred() const { return deferred != nullptr; }
+  DeferredImport *getDeferred() const { return deferred.get(); }
+  void setDeferred(std::shared_ptr<DeferredImport> d) { deferred = std::move(d); }
+
+  ImagePyramid *getPyramid() const { return pyramid.get(); }
+  void setPyramid(std::shared_ptr<ImagePyramid> p) { pyramid = std::move(p); }
+
+  bool isShared() const { return shared != nullptr; }
+
+  void shareImage(Token &other) {
+    if (!other.shared) {
+      other.shared.reset(other.ptr);
+    }
+    ptr = other.ptr;
+    shared = other.shared;
+  }
+
+  void unshare() {
+    if (shared) {
+      ptr = cloneImage(ptr);
+      shared.reset();
+    }
+  }
+
+  void releaseImage() {
+    if (!shared) {
+      delete ptr;
+    }
+    ptr = nullptr;
+    shared.reset();
+  }
+};
+
+// Exported files kept on disk under a key naming the input content and the
+// commands applied to it, so identical runs copy them instead of decoding
+// and processing again. Entries are files named "<content>-<chain>" (two
+// 64-bit hashes in hex); the least recently used ones are removed once the
+// directory grows past its limit. Use updates the files' modification times,
+// so the order survives restarts.
+class ResultCache {
+private:
+  struct Entry {
+    std::string name;
+    uint64_t size;
+  };
+
+  std::mutex mutex;
+  std::string directory;
+  uint64_t limit = 0;
+  uint64_t total = 0;
+  std::list<Entry> entries; // least recently used first
+  std::map<std::string, std::list<Entry>::iterator> index;
+
+  std::string pathOf(const std::string &name) const {
+    return directory + "/" + name;
+  }
+
+  void addEntry(const std::string &name, uint64_t size) {
+    index[name] = entries.insert(entries.end(), {name, size});
+    total += size;
+  }
+
+  void removeEntry(std::map<std::string, std::list<Entry>::iterator>::iterator found) {
+    std::remove(pathOf(found->first).c_str());
+    total -= found->second->size;
+    entries.erase(found->second);
+    index.erase(found);
+  }
+
+  void evict() {
+    while (total > limit && !entries.empty()) {
+      removeEntry(index.find(entries.front().name));
+    }
+  }
+
+  static bool isEntryName(const std::string &name) {
+    return name.size() == 33 && name[16] == '-' &&
+           name.find_first_not_of("0123456789abcdef-") == std::string::npos;
+  }
+
+public:
+  // Takes over `path` (created if needed), keeping what earlier runs left.
+  bool open(const std::string &path, uint64_t bytes) {
+#if defined(__unix__) || defined(__APPLE__)
+    mkdir(path.c_str(), 0755);
+    DIR *dir = opendir(path.c_str());
+    if (!dir) {
+      return false;
+    }
+    std::vector<std::pair<std::pair<time_t, std::string>, uint64_t>> found;
+    while (dirent *item = readdir(dir)) {
+      std::string name = item->d_name;
+      struct stat info;
+      if (isEntryName(name) && stat((path + "/" + name).c_str(), &info) == 0 &&
+          S_ISREG(info.st_mode)) {
+        found.push_back({{info.st_mtime, name}, static_cast<uint64_t>(info.st_size)});
+      }
+    }
+    closedir(dir);
+    std::sort(found.begin(), found.end());
+
+    std::lock_guard<std::mutex> lock(mutex);
+    directory = path;
+    limit = bytes;
+    total = 0;
+    entries.clear();
+    index.clear();
+    for (const auto &entry : found) {
+      addEntry(entry.first.second, entry.second);
+    }
+    evict();
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    directory.clear();
+    entries.clear();
+    index.clear();
+    total = 0;
+  }
+
+  bool isOpen() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return !directory.empty();
+  }
+
+  // Whether any result computed from the content `source` is cached.
+  bool hasSource(const std::string &source) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = index.lower_bound(source + "-");
+    return found != index.end() && found->first.compare(0, source.size(), source) == 0;
+  }
+
+  // Copies the entry `name` to `destination`; false when there is none.
+  bool fetch(const std::string &name, const std::string &destination) {
+    std::ifstream cached;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto found = index.find(name);
+      if (found == index.end()) {
+        return false;
+      }
+      cached.open(pathOf(name), std::ios::binary);
+      if (!cached.is_open()) {
+        removeEntry(found);
+        return false;
+      }
+      entries.splice(entries.end(), entries, found->second);
+#if defined(__unix__) || defined(__APPLE__)
+      utimensat(AT_FDCWD, pathOf(name).c_str(), nullptr, 0);
+#endif
+    }
+    // An entry evicted meanwhile stays readable through the open stream
+    std::ofstream file(destination, std::ios::binary);
+    file << cached.rdbuf();
+    return file.good();
+  }
+
+  // Adds a copy of `filename` as the entry `name`.
+  void store(const std::string &name, const std::string &filename) {
+    std::ifstream source(filename, std::ios::binary | std::ios::ate);
+    uint64_t size = source.is_open() ? static_cast<uint64_t>(source.tellg()) : 0;
+    std::string path, temporary;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (directory.empty() || size == 0 || size > limit || index.count(name)) {
+        return;
+      }
+      path = pathOf(name);
+    }
+    // Written aside and renamed so other processes never see half an entry
+    std::ostringstream suffix;
+    suffix << ".tmp" << std::this_thread::get_id();
+#if defined(__unix__) || defined(__APPLE__)
+    suffix << "." << getpid();
+#endif
+    temporary = path + suffix.str();
+    source.seekg(0);
+    {
+      std::ofstream file(temporary, std::ios::binary);
+      file << source.rdbuf();
+      if (!file.good()) {
+        file.close();
+        std::remove(temporary.c_str());
+        return;
+      }
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+      std::remove(temporary.c_str());
+      return;
+    }
+
+    // Skipped when the cache was moved elsewhere meanwhile
+    std::lock_guard<std::mutex> lock(mutex);
+    if (path == pathOf(name) && !index.count(name)) {
+      addEntry(name, size);
+      evict();
+    }
+  }
+};
+
+// A command line ending in `&`, run in the background by a JobQueue.
+struct Job {
+  enum class State { Queued, Running, Done, Cancelled };
+
+  int id;
+  // The daemon client that submitted the job (see currentClient)
+  int client;
+  std::vector<std::string> command;
+  // The token the command works on; empty when it works on none
+  std::string token;
+  std::function<void(const std::vector<std::string> &, std::ostream &)> run;
+  // The previous job on the same token, until this one starts
+  std::shared_ptr<Job> after;
+  State state = State::Queued;
+  std::atomic<bool> cancelled{false};
+  // Set when the command was undone after a cancel
+  bool interrupted = false;
+  // Set when its client has gone, so nobody will wait for it
+  bool detached = false;
+  std::string replies;
+};
+
+// The job the current thread is running, if any.
+thread_local Job *runningJob = nullptr;
+
+// The daemon client whose commands the current thread runs; 0 for the
+// interactive session. Each client only sees its own jobs.
+thread_local int currentClient = 0;
+
+// Background jobs and the workers that run them. A worker takes the oldest
+// queued job whose previous job on the same token has finished, so the
+// commands on one token run in the order they were given while jobs on
+// different tokens overlap. Foreground commands wait for the jobs on their
+// token with waitForToken(). Finished jobs keep their replies until `wait`
+// prints them. `jobs`, `wait` and `cancel` only see the jobs of the client
+// that gives them.
+class JobQueue {
+private:
+  // Every kernel already runs on all cores, so a couple of workers are
+  // enough to keep one long job from holding up the others.
+  static const int workerCount = 2;
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::list<std::shared_ptr<Job>> queued;
+  std::map<int, std::shared_ptr<Job>> jobs;
+  std::map<std::string, std::weak_ptr<Job>> lastJobs;
+  std::vector<std::thread> workers;
+  int nextId = 1;
+  bool stopping = false;
+
+  static bool isFinished(const Job &job) {
+    return job.state == Job::State::Done || job.state == Job::State::Cancelled;
+  }
+
+  void work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      auto runnable = queued.end();
+      changed.wait(lock, [&] {
+        runnable = std::find_if(queued.begin(), queued.end(),
+                                [](const std::shared_ptr<Job> &job) {
+                                  return !job->after || isFinished(*job->after);
+                                });
+        return stopping || runnable != queued.end();
+      });
+      if (runnable == queued.end()) {
+        return;
+      }
+      std::shared_ptr<Job> job = *runnable;
+      queued.erase(runnable);
+      job->after.reset();
+      if (job->cancelled) {
+        job->state = Job::State::Cancelled;
+        changed.notify_all();
+        continue;
+      }
+
+      job->state = Job::State::Running;
+      lock.unlock();
+      std::ostringstream replies;
+      runningJob = job.get();
+      try {
+        job->run(job->command, replies);
+      } catch (const std::exception &) {
+        replies << "\n-- Invalid command! --" << std::endl;
+      }
+      runningJob = nullptr;
+      lock.lock();
+      job->replies = replies.str();
+      job->state = job->interrupted ? Job::State::Cancelled : Job::State::Done;
+      if (job->detached) {
+        jobs.erase(job->id);
+      }
+      changed.notify_all();
+    }
+  }
+
+public:
+  ~JobQueue() { shutdown(); }
+
+  // Queues `command` and returns its job number.
+  int submit(const std::vector<std::string> &command, const std::string &token,
+             std::function<void(const std::vector<std::string> &, std::ostream &)> run) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (workers.empty()) {
+      for (int w = 0; w < workerCount; w++) {
+        workers.emplace_back(&JobQueue::work, this);
+      }
+    }
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    job->id = nextId++;
+    job->client = currentClient;
+    job->command = command;
+    job->token = token;
+    job->run = std::move(run);
+    if (!token.empty()) {
+      std::shared_ptr<Job> last = lastJobs[token].lock();
+      if (last && !isFinished(*last)) {
+        job->after = last;
+      }
+      lastJobs[token] = job;
+    }
+    queued.push_back(job);
+    jobs[job->id] = job;
+    changed.notify_all();
+    return job->id;
+  }
+
+  // Blocks until every job on `token` has finished.
+  void waitForToken(const std::string &token) {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto found = lastJobs.find(token);
+    if (found == lastJobs.end()) {
+      return;
+    }
+    std::shared_ptr<Job> last = found->second.lock();
+    if (last) {
+      changed.wait(lock, [&] { return isFinished(*last); });
+    }
+  }
+
+  void list(std::ostream &out) {
+    static const char *const states[] = {"queued", "running", "done", "cancelled"};
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &entry : jobs) {
+      const Job &job = *entry.second;
+      if (job.client != currentClient) {
+        continue;
+      }
+      out << "  " << job.id << " " << states[static_cast<int>(job.state)];
+      for (const std::string &word : job.command) {
+        out << " " << word;
+      }
+      out << std::endl;
+    }
+  }
+
+  // Waits for job `id`, or for every job when id is 0, then prints the
+  // replies of the jobs waited for and forgets them. False when there is
+  // no job to wait for.
+  bool wait(int id, std::ostream &out) {
+    std::unique_lock<std::mutex> lock(mutex);
+    std::vector<std::shared_ptr<Job>> waited;
+    for (const auto &entry : jobs) {
+      if (entry.second->client == currentClient && (id == 0 || entry.first == id)) {
+        waited.push_back(entry.second);
+      }
+    }
+    if (waited.empty()) {
+      return false;
+    }
+    for (const std::shared_ptr<Job> &job : waited) {
+      changed.wait(lock, [&] { return isFinished(*job); });
+      if (job->state == Job::State::Cancelled) {
+        out << "[NOP] Job " << job->id << " cancelled" << std::endl;
+      } else {
+        out << "[OK] Job " << job->id << " done" << std::endl << job->replies;
+      }
+      jobs.erase(job->id);
+    }
+    for (auto entry = lastJobs.begin(); entry != lastJobs.end();) {
+      entry = entry->second.expired() ? lastJobs.erase(entry) : std::next(entry);
+    }
+    return true;
+  }
+
+  // Cancels a job that has not finished: a queued job never runs and a
+  // running one is interrupted if its command allows it. False when there
+  // is no such job or it has already finished.
+  bool cancel(int id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = jobs.find(id);
+    if (found == jobs.end() || found->second->client != currentClient ||
+        isFinished(*found->second)) {
+      return false;
+    }
+    found->second->cancelled = true;
+    changed.notify_all();
+    return true;
+  }
+
+  // Forgets the jobs of a client that has gone once they finish; they are
+  // not cancelled, since later commands on their tokens may rely on them.
+  void detachClient(int client) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto entry = jobs.begin(); entry != jobs.end();) {
+      Job &job = *entry->second;
+      if (job.client != client) {
+        ++entry;
+      } else if (isFinished(job)) {
+        entry = jobs.erase(entry);
+      } else {
+        job.detached = true;
+        ++entry;
+      }
+    }
+  }
+
+  // Cancels every job and waits for the workers to finish.
+  void shutdown() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+      for (const auto &entry : jobs) {
+        entry.second->cancelled = true;
+      }
+      for (const std::shared_ptr<Job> &job : queued) {
+        job->state = Job::State::Cancelled;
+      }
+      queued.clear();
+      changed.notify_all();
+    }
+    for (std::thread &worker : workers) {
+      worker.join();
+    }
+    workers.clear();
+  }
+};
+
+// Lets `cancel` interrupt a background job while it changes a token. The
+// kernels build their results beside the image and commitResult() drops
+// them once the job is cancelled, so the image itself is never copied: an
+// interrupted command leaves its pixels as they were, and only the token
+// (history, deferred import, shared image) is put back as it was saved when
+// the command started. An image that is not the saved one was made by the
+// command (a copy of a shared image, a decoded deferred one) and is freed.
+class InterruptibleCommand {
+private:
+  Token *token = nullptr;
+  Job *job = nullptr;
+  Token saved;
+
+public:
+  ~InterruptibleCommand() {
+    if (!token) {
+      return;
+    }
+    cancellation = nullptr;
+    if (!resultDropped) {
+      return;
+    }
+    resultDropped = false;
+    if (token->getPtr() != saved.getPtr()) {
+      token->releaseImage();
+    }
+    *token = saved;
+    if (token->getPyramid()) {
+      token->getPyramid()->reset();
+    }
+    job->interrupted = true;
+  }
+
+  void begin(Token &t, Job &j) {
+    token = &t;
+    job = &j;
+    saved = t;
+    resultDropped = false;
+    cancellation = &j.cancelled;
+  }
+};
+
+// Every token of a session (or of the daemon, shared by all its clients).
+// `mutex` guards the vector itself: commands hold it shared while they use a
+// token, and only import and delete take it exclusively.
+struct TokenDatabase {
+  std::vector<Token> tokens;
+  std::shared_mutex mutex;
+  ResultCache cache;
+  // Last, so that its workers stop before the tokens go away
+  JobQueue jobs;
+};
+
+// QOI ("Quite OK Image") lossless codec. Every pixel becomes a run, a
+// reference into a 64-entry cache of recent colors, a small difference from
+// the previous pixel or, failing all those, a literal, so both directions are
+// one sequential pass with no entropy coder.
+const unsigned char qoiOpIndex = 0x00;
+const unsigned char qoiOpDiff = 0x40;
+const unsigned char qoiOpLuma = 0x80;
+const unsigned char qoiOpRun = 0xc0;
+const unsigned char qoiOpRGB = 0xfe;
+const unsigned char qoiOpRGBA = 0xff;
+const unsigned char qoiMask = 0xc0;
+const size_t qoiHeaderSize = 14;
+// Largest width and height either direction accepts
+const uint32_t qoiMaxSide = 1u << 16;
+// Pixels one op byte can stand for, as a run
+const int qoiMaxRun = 62;
+const unsigned char qoiEnd[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+struct QOIColor {
+  unsigned char r, g, b, a;
+
+  bool operator==(const QOIColor &other) const {
+    return r == other.r && g == other.g && b == other.b && a == other.a;
+  }
+};
+
+int qoiHash(const QOIColor &c) {
+  return (c.r * 3 + c.g * 5 + c.b * 7 + c.a * 11) % 64;
+}
+
+void writeBigEndian32(std::vector<unsigned char> &bytes, uint32_t value) {
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    bytes.push_back(static_cast<unsigned char>(value >> shift));
+  }
+}
+
+uint32_t readBigEndian32(const unsigned char *bytes) {
+  return (static_cast<uint32_t>(bytes[0]) << 24) | (bytes[1] << 16) |
+         (bytes[2] << 8) | bytes[3];
+}
+
+std::vector<unsigned char> encodeQOI(const Plane &red, const Plane &green,
+                                     const Plane &blue) {
+  const int width = red.getWidth();
+  const int height = red.getHeight();
+  const size_t count = static_cast<size_t>(width) * height;
+  std::vector<unsigned char> bytes;
+  bytes.reserve(qoiHeaderSize + count * 4 + sizeof(qoiEnd));
+  bytes.insert(bytes.end(), {'q', 'o', 'i', 'f'});
+  writeBigEndian32(bytes, width);
+  writeBigEndian32(bytes, height);
+  bytes.push_back(3); // channels
+  bytes.push_back(0); // sRGB with linear alpha
+
+  QOIColor index[64] = {};
+  QOIColor previous = {0, 0, 0, 255};
+  int run = 0;
+  for (int i = 0; i < height; i++) {
+    const unsigned char *r = red.row(i);
+    const unsigned char *g = green.row(i);
+    const unsigned char *b = blue.row(i);
+    for (int j = 0; j < width; j++) {
+      QOIColor pixel = {r[j], g[j], b[j], 255};
+      if (pixel == previous) {
+        run++;
+        if (run == qoiMaxRun) {
+          bytes.push_back(qoiOpRun | (run - 1));
+          run = 0;
+        }
+        continue;
+      }
+      if (run > 0) {
+        bytes.push_back(qoiOpRun | (run - 1));
+        run = 0;
+      }
+
+      int hash = qoiHash(pixel);
+      if (index[hash] == pixel) {
+        bytes.push_back(qoiOpIndex | hash);
+      } else {
+        index[hash] = pixel;
+        int dr = static_cast<signed char>(pixel.r - previous.r);
+        int dg = static_cast<signed char>(pixel.g - previous.g);
+        int db = static_cast<signed char>(pixel.b - previous.b);
+        int drg = dr - dg;
+        int dbg = db - dg;
+        if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+          bytes.push_back(qoiOpDiff | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+        } else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 &&
+                   dbg >= -8 && dbg <= 7) {
+          bytes.push_back(qoiOpLuma | (dg + 32));
+          bytes.push_back((drg + 8) << 4 | (dbg + 8));
+        } else {
+          bytes.insert(bytes.end(), {qoiOpRGB, pixel.r, pixel.g, pixel.b});
+        }
+      }
+      previous = pixel;
+    }
+  }
+  if (run > 0) {
+    bytes.push_back(qoiOpRun | (run - 1));
+  }
+  bytes.insert(bytes.end(), qoiEnd, qoiEnd + sizeof(qoiEnd));
+  return bytes;
+}
+
+// Decodes a whole QOI file into red, green and blue planes; alpha is dropped.
+// Returns false on a malformed or truncated stream.
+bool decodeQOI(const std::vector<unsigned char> &bytes, std::vector<Plane> &planes) {
+  if (bytes.size() < qoiHeaderSize + sizeof(qoiEnd) ||
+      std::memcmp(bytes.data(), "qoif", 4) != 0) {
+    return false;
+  }
+  uint32_t width = readBigEndian32(&bytes[4]);
+  uint32_t height = readBigEndian32(&bytes[8]);
+  int channels = bytes[12];
+  if (width == 0 || height == 0 || width > qoiMaxSide || height > qoiMaxSide ||
+      (channels != 3 && channels != 4)) {
+    return false;
+  }
+  // Refuse a stream too short for its size before allocating the planes
+  size_t ops = bytes.size() - qoiHeaderSize - sizeof(qoiEnd);
+  if (static_cast<uint64_t>(width) * height >
+      static_cast<uint64_t>(ops) * qoiMaxRun) {
+    return false;
+  }
+
+  planes.assign(3, Plane(width, height));
+  unsigned char *r = planes[0].row(0);
+  unsigned char *g = planes[1].row(0);
+  unsigned char *b = planes[2].row(0);
+  const size_t count = static_cast<size_t>(width) * height;
+  const size_t end = bytes.size() - sizeof(qoiEnd);
+
+  QOIColor index[64] = {};
+  QOIColor pixel = {0, 0, 0, 255};
+  size_t position = qoiHeaderSize;
+  int run = 0;
+  for (size_t p = 0; p < count; p++) {
+    if (run > 0) {
+      run--;
+    } else {
+      if (position >= end) {
+        return false;
+      }
+      unsigned char op = bytes[position++];
+      if (op == qoiOpRGB || op == qoiOpRGBA) {
+        size_t length = op == qoiOpRGB ? 3 : 4;
+        if (position + length > end) {
+          return false;
+        }
+        pixel.r = bytes[position];
+        pixel.g = bytes[position + 1];
+        pixel.b = bytes[position + 2];
+        if (op == qoiOpRGBA) {
+          pixel.a = bytes[position + 3];
+        }
+        position += length;
+      } else if ((op & qoiMask) == qoiOpIndex) {
+        pixel = index[op];
+      } else if ((op & qoiMask) == qoiOpDiff) {
+        pixel.r += ((op >> 4) & 0x03) - 2;
+        pixel.g += ((op >> 2) & 0x03) - 2;
+        pixel.b += (op & 0x03) - 2;
+      } else if ((op & qoiMask) == qoiOpLuma) {
+        if (position >= end) {
+          return false;
+        }
+        unsigned char second = bytes[position++];
+        int dg = (op & 0x3f) - 32;
+        pixel.r += dg - 8 + ((second >> 4) & 0x0f);
+        pixel.g += dg;
+        pixel.b += dg - 8 + (second & 0x0f);
+      } else {
+        run = op & 0x3f;
+      }
+      index[qoiHash(pixel)] = pixel;
+    }
+    r[p] = pixel.r;
+    g[p] = pixel.g;
+    b[p] = pixel.b;
+  }
+  return true;
+}
+
+// QOI has no grayscale mode, so images whose pixels are all gray come back
+// as grayscale images and everything else as RGB.
+Image *readQOIImage(std::istream &stream, std::ostream &out) {
+  stream.seekg(0);
+  std::vector<unsigned char> bytes((std::istreambuf_iterator<char>(stream)),
+                                   std::istreambuf_iterator<char>());
+  std::vector<Plane> planes;
+  if (!decodeQOI(bytes, planes)) {
+    out << "[ERROR] Corrupt QOI file" << std::endl;
+    return nullptr;
+  }
+
+  bool gray = true;
+  for (int i = 0; i < planes[0].getHeight() && gray; i++) {
+    gray = std::equal(planes[0].row(i), planes[0].row(i) + planes[0].getWidth(),
+                      planes[1].row(i)) &&
+           std::equal(planes[0].row(i), planes[0].row(i) + planes[0].getWidth(),
+                      planes[2].row(i));
+  }
+  if (gray) {
+    GSCImage *image = new GSCImage();
+    image->setChannels({planes[0]});
+    return image;
+  }
+  RGBImage *image = new RGBImage();
+  image->setChannels(planes);
+  return image;
+}
+
+// A whole file mapped read-only into memory. Where mapping is unavailable (or
+// fails, e.g. for pipes) isOpen() is false and callers fall back to streams.
+class MappedFile {
+private:
+  const char *data = nullptr;
+  size_t size = 0;
+
+public:
+  explicit MappedFile(const char *filename) {
+#if defined(__unix__) || defined(__APPLE__)
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+      void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapping != MAP_FAILED) {
+        data = static_cast<const char *>(mapping);
+        size = info.st_size;
+        madvise(mapping, size, MADV_SEQUENTIAL);
+      }
+    }
+    close(fd);
+#else
+    (void)filename;
+#endif
+  }
+
+  ~MappedFile() {
+#if defined(__unix__) || defined(__APPLE__)
+    if (data) {
+      munmap(const_cast<char *>(data), size);
+    }
+#endif
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  bool isOpen() const { return data != nullptr; }
+  const char *begin() const { return data; }
+  const char *end() const { return data + size; }
+};
+
+// xxHash64 (seed 0): four independent lanes over 32-byte blocks, so hashing
+// an input costs about as much as reading it.
+uint64_t contentHash(const void *data, size_t size) {
+  const uint64_t prime1 = 11400714785074694791ULL;
+  const uint64_t prime2 = 14029467366897019727ULL;
+  const uint64_t prime3 = 1609587929392839161ULL;
+  const uint64_t prime4 = 9650029242287828579ULL;
+  const uint64_t prime5 = 2870177450012600261ULL;
+  auto rotate = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+  auto round = [&](uint64_t acc, uint64_t input) {
+    return rotate(acc + input * prime2, 31) * prime1;
+  };
+  auto read64 = [](const unsigned char *p) {
+    uint64_t value;
+    std::memcpy(&value, p, 8);
+    return value;
+  };
+
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+  const unsigned char *end = p + size;
+  uint64_t hash;
+  if (size >= 32) {
+    uint64_t lanes[4] = {prime1 + prime2, prime2, 0, 0 - prime1};
+    for (; p + 32 <= end; p += 32) {
+      for (int k = 0; k < 4; k++) {
+        lanes[k] = round(lanes[k], read64(p + 8 * k));
+      }
+    }
+    hash = rotate(lanes[0], 1) + rotate(lanes[1], 7) + rotate(lanes[2], 12) +
+           rotate(lanes[3], 18);
+    for (uint64_t lane : lanes) {
+      hash = (hash ^ round(0, lane)) * prime1 + prime4;
+    }
+  } else {
+    hash = prime5;
+  }
+  hash += size;
+
+  for (; p + 8 <= end; p += 8) {
+    hash = rotate(hash ^ round(0, read64(p)), 27) * prime1 + prime4;
+  }
+  if (p + 4 <= end) {
+    uint32_t value;
+    std::memcpy(&value, p, 4);
+    hash = rotate(hash ^ (value * prime1), 23) * prime2 + prime3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    hash = rotate(hash ^ (*p * prime5), 11) * prime1;
+  }
+  hash ^= hash >> 33;
+  hash *= prime2;
+  hash ^= hash >> 29;
+  hash *= prime3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+std::string hashString(uint64_t hash) {
+  const char *digits = "0123456789abcdef";
+  std::string text(16, '0');
+  for (int k = 15; k >= 0; k--, hash >>= 4) {
+    text[k] = digits[hash & 15];
+  }
+  return text;
+}
+
+bool isNetpbmSpace(char c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\v' ||
+         c == '\f';
+}
+
+// Parses the decimal token at p (the way `stream >> int` would, saturating
+// instead of failing on overflow) and returns the position after the token.
+const char *parseNetpbmValue(const char *p, const char *end, int &value) {
+  bool negative = p < end && *p == '-';
+  if (p < end && (*p == '-' || *p == '+')) {
+    p++;
+  }
+  long long magnitude = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    magnitude = std::min(magnitude * 10 + (*p - '0'), 1LL << 31);
+    p++;
+  }
+  value = static_cast<int>(negative ? -std::min(magnitude, 1LL << 31)
+                                    : std::min(magnitude, (1LL << 31) - 1));
+  while (p < end && !isNetpbmSpace(*p)) {
+    p++;
+  }
+  return p;
+}
+
+const char *skipNetpbmSpace(const char *p, const char *end) {
+  while (p < end && isNetpbmSpace(*p)) {
+    p++;
+  }
+  return p;
+}
+
+struct NetpbmHeader {
+  int channels;
+  int width;
+  int height;
+  int maxValue;
+  const char *body;
+};
+
+// Parses a P2/P3 header; false when it is not one readNetpbmText handles.
+bool parseNetpbmHeader(const MappedFile &file, NetpbmHeader &header) {
+  const char *p = skipNetpbmSpace(file.begin(), file.end());
+  if (file.end() - p < 2 || p[0] != 'P' || (p[1] != '2' && p[1] != '3') ||
+      (p + 2 < file.end() && !isNetpbmSpace(p[2]))) {
+    return false;
+  }
+  header.channels = p[1] == '3' ? 3 : 1;
+  p += 2;
+
+  int values[3];
+  for (int &value : values) {
+    p = skipNetpbmSpace(p, file.end());
+    if (p == file.end()) {
+      return false;
+    }
+    p = parseNetpbmValue(p, file.end(), value);
+  }
+  header.width = values[0];
+  header.height = values[1];
+  header.maxValue = clampMaxval(values[2]);
+  header.body = p;
+  return header.width > 0 && header.height > 0;
+}
+
+// A text body cut into one chunk per worker at whitespace, so no sample
+// straddles two chunks, with counts[c] the index of the first sample of
+// chunk c (counts[chunks] being the total).
+struct NetpbmChunks {
+  std::vector<const char *> bounds;
+  std::vector<size_t> counts;
+};
+
+NetpbmChunks splitNetpbmBody(const char *body, const char *end) {
+  const size_t length = end - body;
+  const size_t minimumChunk = 1 << 16;
+  int chunks = static_cast<int>(std::max<size_t>(
+      1, std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()),
+                          length / minimumChunk)));
+  NetpbmChunks split;
+  std::vector<const char *> &bounds = split.bounds;
+  bounds.assign(chunks + 1, end);
+  bounds[0] = body;
+  for (int c = 1; c < chunks; c++) {
+    const char *bound =
+        std::max(bounds[c - 1], body + length * c / chunks);
+    while (bound < end && !isNetpbmSpace(*bound)) {
+      bound++;
+    }
+    bounds[c] = bound;
+  }
+
+  // Chunks start on whitespace (the body starts right after maxval), so a
+  // sample begins wherever a non-space character follows a space.
+  std::vector<size_t> &counts = split.counts;
+  counts.assign(chunks + 1, 0);
+  parallelFor(0, chunks, [&](int first, int last) {
+    for (int c = first; c < last; c++) {
+      size_t count = 0;
+      bool inSample = false;
+      for (const char *q = bounds[c]; q < bounds[c + 1]; q++) {
+        bool space = isNetpbmSpace(*q);
+        count += !space && !inSample;
+        inSample = !space;
+      }
+      counts[c + 1] = count;
+    }
+  });
+  for (int c = 0; c < chunks; c++) {
+    counts[c + 1] += counts[c];
+  }
+  return split;
+}
+
+// Where sample `index` starts, or the end of the body if there is none.
+const char *findNetpbmSample(const NetpbmChunks &split, size_t index) {
+  const char *end = split.bounds.back();
+  if (index >= split.counts.back()) {
+    return end;
+  }
+  size_t c = std::upper_bound(split.counts.begin(), split.counts.end(), index) -
+             split.counts.begin() - 1;
+  const char *q = skipNetpbmSpace(split.bounds[c], end);
+  for (size_t skip = index - split.counts[c]; skip > 0; skip--) {
+    while (q < end && !isNetpbmSpace(*q)) {
+      q++;
+    }
+    q = skipNetpbmSpace(q, end);
+  }
+  return q;
+}
+
+Image *newNetpbmImage(int channels, int maxValue,
+                      const std::vector<WidePlane> &planes) {
+  Image *image;
+  if (channels == 3) {
+    image = new RGBImage();
+  } else {
+    image = new GSCImage();
+  }
+  image->setWideChannels(planes);
+  image->setMaxLuminocity(maxValue);
+  return image;
+}
+
+// Decodes a mapped P2/P3 file on every core. Each worker parses its chunks
+// of splitNetpbmBody() straight into the planes, starting at the sample
+// index the chunk counts give it. Returns nullptr when the header is not
+// one this decoder handles, leaving the file to the stream readers.
+Image *readNetpbmText(const MappedFile &file) {
+  NetpbmHeader header;
+  if (!parseNetpbmHeader(file, header)) {
+    return nullptr;
+  }
+  const int channels = header.channels;
+  const int width = header.width;
+  const int height = header.height;
+  const int maxValue = header.maxValue;
+  const NetpbmChunks split = splitNetpbmBody(header.body, file.end());
+  const std::vector<const char *> &bounds = split.bounds;
+  const int chunks = static_cast<int>(bounds.size()) - 1;
+
+  // Samples missing from a short file stay 0 and extra ones are ignored,
+  // as with the stream readers.
+  const size_t total = static_cast<size_t>(width) * height * channels;
+  std::vector<WidePlane> planes(channels, WidePlane(width, height));
+  parallelFor(0, chunks, [&](int first, int last) {
+    for (int c = first; c < last; c++) {
+      size_t index = split.counts[c];
+      const char *q = skipNetpbmSpace(bounds[c], bounds[c + 1]);
+      while (q < bounds[c + 1] && index < total) {
+        int value;
+        q = parseNetpbmValue(q, bounds[c + 1], value);
+        planes[index % channels].row(0)[index / channels] =
+            clampSample(value, maxValue);
+        index++;
+        q = skipNetpbmSpace(q, bounds[c + 1]);
+      }
+    }
+  });
+  return newNetpbmImage(channels, maxValue, planes);
+}
+
+// readNetpbmText() followed by shrinkPlane(), without the full-size planes:
+// every worker decodes a band of output rows, starting at the band's first
+// input sample, and sums input rows into one output row as it parses them.
+// Memory stays proportional to the output.
+Image *readNetpbmTextShrunk(const MappedFile &file, const ShrinkTarget &target) {
+  NetpbmHeader header;
+  if (!parseNetpbmHeader(file, header)) {
+    return nullptr;
+  }
+  const int channels = header.channels;
+  const int width = header.width;
+  const int height = header.height;
+  const int maxValue = header.maxValue;
+  int newWidth, newHeight;
+  target.apply(width, height, newWidth, newHeight);
+
+  const NetpbmChunks split = splitNetpbmBody(header.body, file.end());
+  const char *end = split.bounds.back();
+  std::vector<int> columns, columnCounts, rows, rowCounts;
+  shrinkBoxes(width, newWidth, columns, columnCounts);
+  shrinkBoxes(height, newHeight, rows, rowCounts);
+
+  std::vector<WidePlane> planes(channels, WidePlane(newWidth, newHeight));
+  parallelFor(0, newHeight, [&](int first, int last) {
+    std::vector<uint64_t> sums(static_cast<size_t>(newWidth) * channels);
+    int y = static_cast<int>((static_cast<int64_t>(first) * height + newHeight - 1) /
+                             newHeight);
+    const char *q = findNetpbmSample(split, static_cast<size_t>(y) * width * channels);
+    for (int i = first; i < last; i++) {
+      std::fill(sums.begin(), sums.end(), 0);
+      for (; y < height && rows[y] == i; y++) {
+        for (int x = 0; x < width; x++) {
+          uint64_t *sum = &sums[static_cast<size_t>(columns[x]) * channels];
+          for (int c = 0; c < channels; c++) {
+            // Samples missing from a short file count as 0
+            int value = 0;
+            if (q < end) {
+              q = skipNetpbmSpace(parseNetpbmValue(q, end, value), end);
+            }
+            sum[c] += clampSample(value, maxValue);
+          }
+        }
+      }
+      for (int c = 0; c < channels; c++) {
+        uint16_t *out = planes[c].row(i);
+        for (int j = 0; j < newWidth; j++) {
+          uint64_t count = static_cast<uint64_t>(rowCounts[i]) * columnCounts[j];
+          out[j] = static_cast<uint16_t>(
+              (sums[static_cast<size_t>(j) * channels + c] + count / 2) / count);
+        }
+      }
+    }
+  });
+  return newNetpbmImage(channels, maxValue, planes);
+}
+
+// Images handed to other processes through POSIX shared memory ("shm:name"
+// in place of a filename). The segment holds this header and then every
+// channel as a plane whose rows are `stride` bytes apart. Chroma planes of
+// subsampled YUV images are (width + factor - 1) / factor samples wide and
+// use the stride for that width. Samples are 2 bytes in native byte order
+// when maxval is above 255 and 1 byte otherwise.
+enum SharedImageType : uint32_t {
+  SharedGrayscale = 1,
+  SharedRGB = 3,
+  SharedYUV = 4
+};
+
+struct SharedImageHeader {
+  char magic[4]; // "HW4I"
+  uint32_t type;
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  uint32_t maxval;
+  uint32_t sampleBytes;
+  uint32_t chromaFactorX;
+  uint32_t chromaFactorY;
+};
+
+// Plane data starts at sharedImageOffset and rows at multiples of
+// sharedImageAlignment, so readers can use aligned SIMD loads.
+const size_t sharedImageOffset = 64;
+const size_t sharedImageAlignment = 64;
+
+size_t sharedImageStride(size_t width, size_t sampleBytes) {
+  return (width * sampleBytes + sharedImageAlignment - 1) /
+         sharedImageAlignment * sharedImageAlignment;
+}
+
+bool isSharedMemoryName(const std::string &filename) {
+  return filename.compare(0, 4, "shm:") == 0 && filename.size() > 4;
+}
+
+// POSIX only promises portable behaviour for names with one leading slash.
+std::string sharedMemoryName(const std::string &filename) {
+  std::string name = filename.substr(4);
+  return name[0] == '/' ? name : "/" + name;
+}
+
+// Byte size of the planes described by `header`; 0 when it is not valid.
+size_t sharedImageBytes(const SharedImageHeader &header) {
+  int channels = header.type == SharedGrayscale ? 1 : 3;
+  if ((header.type != SharedGrayscale && header.type != SharedRGB &&
+       header.type != SharedYUV) ||
+      header.width == 0 || header.height == 0 || header.width > 1u << 16 ||
+      header.height > 1u << 16 || (header.sampleBytes != 1 && header.sampleBytes != 2) ||
+      header.chromaFactorX < 1 || header.chromaFactorX > 2 ||
+      header.chromaFactorY < 1 || header.chromaFactorY > header.chromaFactorX ||
+      header.stride != sharedImageStride(header.width, header.sampleBytes)) {
+    return 0;
+  }
+  size_t bytes = 0;
+  for (int c = 0; c < channels; c++) {
+    size_t factorX = c > 0 ? header.chromaFactorX : 1;
+    size_t factorY = c > 0 ? header.chromaFactorY : 1;
+    size_t width = (header.width + factorX - 1) / factorX;
+    size_t height = (header.height + factorY - 1) / factorY;
+    bytes += sharedImageStride(width, header.sampleBytes) * height;
+  }
+  return bytes;
+}
+
+template <typename T>
+void copyPlaneToShared(const BasicPlane<T> &plane, unsigned char *target,
+                       size_t stride) {
+  parallelFor(0, plane.getHeight(), [&](int first, int last) {
+    for (int i = first; i < last; i++) {
+      std::memcpy(target + i * stride, plane.row(i), plane.getWidth() * sizeof(T));
+    }
+  });
+}
+
+template <typename T>
+void copyPlaneFromShared(const unsigned char *source, size_t stride,
+                         BasicPlane<T> &plane) {
+  parallelFor(0, plane.getHeight(), [&](int first, int last) {
+    for (int i = first; i < last; i++) {
+      std::memcpy(plane.row(i), source + i * stride, plane.getWidth() * sizeof(T));
+    }
+  });
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+// Publishes the image as a new segment; an existing segment of the same
+// name is left alone. The segment lives until a consumer unlinks it.
+bool exportSharedImage(const Image *image, const std::string &filename,
+                       std::ostream &out) {
+  SharedImageHeader header = {{'H', 'W', '4', 'I'}, SharedRGB, 0, 0, 0, 0, 1, 1, 1};
+  header.width = image->getWidth();
+  header.height = image->getHeight();
+  header.maxval = image->getMaxLuminocity();
+  header.sampleBytes = image->isWide() ? 2 : 1;
+  header.stride = sharedImageStride(header.width, header.sampleBytes);
+  if (dynamic_cast<const GSCImage *>(image)) {
+    header.type = SharedGrayscale;
+  } else if (dynamic_cast<const YUVImage *>(image)) {
+    int factorX, factorY;
+    image->getChannelSubsampling(1, factorX, factorY);
+    header.type = SharedYUV;
+    header.chromaFactorX = factorX;
+    header.chromaFactorY = factorY;
+  }
+  // Readers refuse sides over 65536, so such an image is not published
+  size_t bytes = sharedImageBytes(header);
+  if (bytes == 0) {
+    out << "[ERROR] Image too large for shared memory\n";
+    return false;
+  }
+  size_t size = sharedImageOffset + bytes;
+
+  std::string name = sharedMemoryName(filename);
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0) {
+    out << (errno == EEXIST ? "[ERROR] File exists\n"
+                            : "[ERROR] Unable to create file\n");
+    return false;
+  }
+  void *mapping = MAP_FAILED;
+  if (ftruncate(fd, size) == 0) {
+    mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    shm_unlink(name.c_str());
+    out << "[ERROR] Unable to create file\n";
+    return false;
+  }
+
+  unsigned char *target = static_cast<unsigned char *>(mapping) + sharedImageOffset;
+  for (int c = 0; c < image->getChannels(); c++) {
+    const YUVImage *yuvImage = dynamic_cast<const YUVImage *>(image);
+    size_t height, stride;
+    if (yuvImage) {
+      const Plane &plane = yuvImage->getPlane(c);
+      stride = sharedImageStride(plane.getWidth(), 1);
+      height = plane.getHeight();
+      copyPlaneToShared(plane, target, stride);
+    } else if (image->isWide()) {
+      stride = header.stride;
+      height = header.height;
+      copyPlaneToShared(image->getWideChannel(c), target, stride);
+    } else {
+      stride = header.stride;
+      height = header.height;
+      copyPlaneToShared(image->getChannel(c), target, stride);
+    }
+    target += stride * height;
+  }
+  // The header goes last so a reader never sees a complete header over
+  // incomplete planes.
+  std::memcpy(mapping, &header, sizeof(header));
+  munmap(mapping, size);
+  return true;
+}
+
+Image *readSharedImage(const std::string &filename, std::ostream &out) {
+  std::string name = sharedMemoryName(filename);
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    out << "[ERROR] Unable to open " << filename << std::endl;
+    return nullptr;
+  }
+  struct stat info;
+  void *mapping = MAP_FAILED;
+  size_t size = 0;
+  if (fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) > sharedImageOffset) {
+    size = info.st_size;
+    mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    out << "[ERROR] Invalid file format" << std::endl;
+    return nullptr;
+  }
+
+  SharedImageHeader header;
+  std::memcpy(&header, mapping, sizeof(header));
+  size_t bytes = sharedImageBytes(header);
+  if (std::memcmp(header.magic, "HW4I", 4) != 0 || bytes == 0 ||
+      sharedImageOffset + bytes > size ||
+      (header.type == SharedYUV && header.sampleBytes != 1)) {
+    munmap(mapping, size);
+    out << "[ERROR] Invalid file format" << std::endl;
+    return nullptr;
+  }
+
+  const unsigned char *source =
+      static_cast<const unsigned char *>(mapping) + sharedImageOffset;
+  const int width = header.width;
+  const int height = header.height;
+  Image *image = nullptr;
+  if (header.type == SharedYUV) {
+    ChromaSubsampling subsampling =
+        header.chromaFactorY == 2   ? ChromaSubsampling::Yuv420
+        : header.chromaFactorX == 2 ? ChromaSubsampling::Yuv422
+                                    : ChromaSubsampling::Yuv444;
+    YUVImage *yuvImage = new YUVImage(width, height, subsampling);
+    for (int c = 0; c < 3; c++) {
+      Plane &plane = yuvImage->getPlane(c);
+      size_t stride = sharedImageStride(plane.getWidth(), 1);
+      copyPlaneFromShared(source, stride, plane);
+      source += stride * plane.getHeight();
+    }
+    image = yuvImage;
+  } else {
+    int channels = header.type == SharedGrayscale ? 1 : 3;
+    if (header.type == SharedGrayscale) {
+      image = new GSCImage();
+    } else {
+      image = new RGBImage();
+    }
+    image->setMaxLuminocity(clampMaxval(header.maxval));
+    if (header.sampleBytes == 2) {
+      std::vector<WidePlane> planes(channels, WidePlane(width, height));
+      for (WidePlane &plane : planes) {
+        copyPlaneFromShared(source, header.stride, plane);
+        source += header.stride * height;
+      }
+      image->setWideChannels(planes);
+    } else {
+      std::vector<Plane> planes(channels, Plane(width, height));
+      for (Plane &plane : planes) {
+        copyPlaneFromShared(source, header.stride, plane);
+        source += header.stride * height;
+      }
+      image->setChannels(planes);
+    }
+  }
+  munmap(mapping, size);
+  return image;
+}
+#else
+bool exportSharedImage(const Image *image, const std::string &filename,
+                       std::ostream &out) {
+  out << "[ERROR] Shared memory needs POSIX\n";
+  return false;
+}
+
+Image *readSharedImage(const std::string &filename, std::ostream &out) {
+  out << "[ERROR] Shared memory needs POSIX" << std::endl;
+  return nullptr;
+}
+#endif
+
+Image *readNetpbmImage(const char *filename, std::ostream &out) {
+  if (isSharedMemoryName(filename)) {
+    return readSharedImage(filename, out);
+  }
+
+  std::ifstream f(filename);
+  if (!f.is_open()) {
+    out << "[ERROR] Unable to open " << filename << std::endl;
+  }
+  Image *img_ptr = nullptr;
+  std::string type;
+
+  // QOI is binary, so its magic is checked before reading a text token
+  char magic[4] = {0};
+  if (f.read(magic, 4) && std::memcmp(magic, "qoif", 4) == 0) {
+    return readQOIImage(f, out);
+  }
+  f.clear();
+  f.seekg(0);
+
+  MappedFile mapped(filename);
+  if (mapped.isOpen()) {
+    img_ptr = readNetpbmText(mapped);
+    if (img_ptr) {
+      return img_ptr;
+    }
+  }
+
+  if (f.good() && !f.eof())
+    f >> type;
+  if (!type.compare("P3")) {
+    img_ptr = new RGBImage(f);
+  } else if (!type.compare("P2")) {
+    img_ptr = new GSCImage(f);
+  } else if (f.is_open()) {
+    out << "[ERROR] Invalid file format" << std::endl;
+  }
+  return img_ptr;
+}
+
+bool tokenExists(const std::vector<Token> &tokens,
+                 const std::string &tokenName) {
+  return std::find_if(tokens.begin(), tokens.end(),
+                      [tokenName](const Token &token) {
+                        return token.getName() == tokenName;
+                      }) != tokens.end();
+}
+
+Token *findToken(const std::vector<Token> &tokenDatabase,
+                 const std::string &token) {
+  for (const Token &t : tokenDatabase) {
+    if (t.getName() == token) {
+      return const_cast<Token *>(&t);
+    }
+  }
+  return nullptr;
+}
+
+bool fileExists(const std::string &filename) {
+  std::ifstream file(filename);
+  return file.good();
+}
+
+bool exportPGMImage(const GSCImage *image, const std::string &filename,
+                    std::ostream &out) {
+  std::ofstream file(filename);
+  if (!file.is_open()) {
+    out << "[ERROR] Unable to create file\n";
+    return false;
+  }
+
+  int width = image->getWidth();
+  int height = image->getHeight();
+
+  file << "P2\n";
+  file << width << " " << height << " " << image->getMaxLuminocity() << "\n";
+
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      const Pixel &pixel = image->getPixel(y, x);
+      const GSCPixel &gscPixel = dynamic_cast<const GSCPixel &>(pixel);
+      int luminosity = gscPixel.getValue();
+      file << static_cast<int>(luminosity) << "\n";
+    }
+  }
+  return true;
+}
+
+bool exportPPMImage(const RGBImage *image, const std::string &filename,
+                    std::ostream &out) {
+  std::ofstream file(filename);
+  if (!file.is_open()) {
+    out << "[ERROR] Unable to create file\n";
+    return false;
+  }
+
+  int width = image->getWidth();
+  int height = image->getHeight();
+
+  file << "P3\n";
+  file << width << " " << height << " " << image->getMaxLuminocity() << "\n";
+
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      const Pixel &pixel = image->getPixel(y, x);
+      const RGBPixel &rgbPixel = dynamic_cast<const RGBPixel &>(pixel);
+      int red = rgbPixel.getRed();
+      int green = rgbPixel.getGreen();
+      int blue = rgbPixel.getBlue();
+      file << static_cast<int>(red) << " " << static_cast<int>(green) << " "
+           << static_cast<int>(blue) << "\n";
+    }
+  }
+  return true;
+}
+
+bool exportYUVImage(const YUVImage *image, const std::string &filename,
+                    std::ostream &out) {
+  std::ofstream file(filename);
+  if (!file.is_open()) {
+    out << "[ERROR] Unable to create file\n";
+    return false;
+  }
+
+  int width = image->getWidth();
+  int height = image->getHeight();
+
+  file << "P3\n";
+  file << width << " " << height << " "
+       << "255\n";
+
+  // Read from the planes rather than getPixel(), whose shared snapshot
+  // would race with concurrent exports of the same image
+  int factorX, factorY;
+  image->getChannelSubsampling(1, factorX, factorY);
+  for (int y = 0; y < height; y++) {
+    const unsigned char *luma = image->getPlane(0).row(y);
+    const unsigned char *u = image->getPlane(1).row(y / factorY);
+    const unsigned char *v = image->getPlane(2).row(y / factorY);
+    for (int x = 0; x < width; x++) {
+      file << static_cast<int>(luma[x]) << " "
+           << static_cast<int>(u[x / factorX]) << " "
+           << static_cast<int>(v[x / factorX]) << "\n";
+    }
+  }
+  return true;
+}
+
+// Writes RGB and grayscale images (as gray RGB) in QOI. 16-bit images have
+// to be exported as PGM/PPM.
+bool exportQOIImage(const Image *image, const std::string &filename,
+                    std::ostream &out) {
+  std::ofstream file(filename, std::ios::binary);
+  if (!file.is_open()) {
+    out << "[ERROR] Unable to create file\n";
+    return false;
+  }
+
+  std::vector<unsigned char> bytes;
+  if (image->getChannels() == 1) {
+    Plane gray = image->getChannel(0);
+    bytes = encodeQOI(gray, gray, gray);
+  } else {
+    bytes = encodeQOI(image->getChannel(0), image->getChannel(1),
+                      image->getChannel(2));
+  }
+  file.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+  return static_cast<bool>(file);
+}
+
+bool hasExtension(const std::string &filename, const std::string &extension) {
+  if (filename.size() < extension.size()) {
+    return false;
+  }
+  return std::equal(extension.begin(), extension.end(),
+                    filename.end() - extension.size(), [](char a, char b) {
+                      return std::tolower(static_cast<unsigned char>(a)) ==
+                             std::tolower(static_cast<unsigned char>(b));
+                    });
+}
+
+void deleteToken(std::vector<Token> &tokenDatabase,
+                 const std::string &tokenName, std::ostream &out) {
+  auto tokenIterator = std::find_if(
+      tokenDatabase.begin(), tokenDatabase.end(),
+      [&](const Token &token) { return token.getName() == tokenName; });
+
+  if (tokenIterator != tokenDatabase.end()) {
+    tokenIterator->releaseImage();
+    tokenDatabase.erase(tokenIterator);
+    out << "[OK] Delete " << tokenName << std::endl;
+  } else {
+    out << "[ERROR] Token " << tokenName << " not found!" << std::endl;
+  }
+}
+
+Image &rotate(Image &image, int times) { return image += times; }
+
+Image &resize(Image &image, double factor) { return image *= factor; }
+
+Image &mirrorVertical(Image &image) { return *image; }
+
+Image &reverseBrightness(Image &image) { return !image; }
+
+Image &histogramEqualization(Image &image) { return ~image; }
+
+// Channels a spatial filter should touch: every channel of RGB and grayscale
+// images, but only the luma plane of YUV so chroma is left as it was.
+int detailChannels(const Image &image) {
+  if (dynamic_cast<const YUVImage *>(&image)) {
+    return 1;
+  }
+  return image.getChannels();
+}
+
+// `kernel` is called with a Plane or, for 16-bit images, a WidePlane. Every
+// channel is filtered before any is replaced, so a dropped result leaves the
+// image as it was.
+template <typename Kernel> Image &filterChannels(Image &image, Kernel kernel) {
+  int channels = detailChannels(image);
+  if (image.isWide()) {
+    std::vector<WidePlane> filtered;
+    for (int c = 0; c < channels; c++) {
+      filtered.push_back(kernel(image.getWideChannel(c)));
+    }
+    if (commitResult()) {
+      for (int c = 0; c < channels; c++) {
+        image.setWideChannel(c, filtered[c]);
+      }
+    }
+  } else {
+    std::vector<Plane> filtered;
+    for (int c = 0; c < channels; c++) {
+      filtered.push_back(kernel(image.getChannel(c)));
+    }
+    if (commitResult()) {
+      for (int c = 0; c < channels; c++) {
+        image.setChannel(c, filtered[c]);
+      }
+    }
+  }
+  return image;
+}
+
+Image &gaussianBlur(Image &image, double sigma, EdgeMode edge) {
+  SeparableKernel kernel = SeparableKernel::gaussian(sigma);
+  return filterChannels(image, [&](const auto &plane) {
+    return convolveSeparable(plane, kernel, edge);
+  });
+}
+
+Image &boxBlur(Image &image, int radius, EdgeMode edge) {
+  return filterChannels(image, [&](const auto &plane) {
+    return boxBlurPlane(plane, radius, edge);
+  });
+}
+
+Image &unsharpMask(Image &image, double sigma, double amount, EdgeMode edge) {
+  int maxValue = image.getSampleMaximum();
+  return filterChannels(image, [&](const auto &plane) {
+    return unsharpMaskPlane(plane, sigma, amount, edge, maxValue);
+  });
+}
+
+std::string channelName(const Image &image, int channel) {
+  if (dynamic_cast<const GSCImage *>(&image)) {
+    return "gray";
+  }
+  if (dynamic_cast<const YUVImage *>(&image)) {
+    const char *names[] = {"y", "u", "v"};
+    return names[channel];
+  }
+  const char *names[] = {"red", "green", "blue"};
+  return names[channel];
+}
+
+void printRegionStatistics(std::ostream &out, const Image &image, int x, int y,
+                           int w, int h) {
+  for (int c = 0; c < image.getChannels(); c++) {
+    RegionStatistics stats = image.getRegionStatistics(c, x, y, w, h);
+    out << "  " << channelName(image, c) << ": mean " << stats.mean
+        << " variance " << stats.variance << " min " << stats.minimum
+        << " max " << stats.maximum << std::endl;
+  }
+}
+
+void printHistogram(std::ostream &out, const Image &image) {
+  for (int c = 0; c < image.getChannels(); c++) {
+    out << "  " << channelName(image, c) << ":";
+    for (uint64_t count : image.getChannelHistogram(c)) {
+      out << " " << count;
+    }
+    out << std::endl;
+  }
+  RegionStatistics luma = histogramStatistics(image.getLumaHistogram());
+  out << "  luma: mean " << luma.mean << " variance " << luma.variance
+      << " min " << luma.minimum << " max " << luma.maximum << std::endl;
+}
+
+// Converts `image` for comparison with `other`: YUV becomes RGB, and gray
+// becomes RGB when `other` is in color. Returns `image` itself when nothing
+// needs converting and otherwise the copy kept in `converted`.
+const Image &comparableImage(const Image &image, const Image &other,
+                             std::unique_ptr<Image> &converted) {
+  // The RGBImage conversions consume their argument, so they get a copy
+  bool color = dynamic_cast<const GSCImage *>(&other) == nullptr;
+  if (dynamic_cast<const YUVImage *>(&image)) {
+    converted.reset(new RGBImage(*static_cast<YUVImage *>(cloneImage(&image))));
+  } else if (color && dynamic_cast<const GSCImage *>(&image)) {
+    converted.reset(new RGBImage(*static_cast<GSCImage *>(cloneImage(&image))));
+  } else {
+    return image;
+  }
+  return *converted;
+}
+
+// Compares two images of the same kind, size and maxval channel by channel.
+// `difference`, a copy of `a` or null, is given |a - b| in every channel.
+std::vector<ChannelComparison> compareImages(const Image &a, const Image &b,
+                                             Image *difference) {
+  std::vector<ChannelComparison> channels;
+  std::vector<Plane> planes;
+  std::vector<WidePlane> widePlanes;
+  for (int c = 0; c < a.getChannels(); c++) {
+    if (a.isWide()) {
+      WidePlane planeA = a.getWideChannel(c);
+      WidePlane planeB = b.getWideChannel(c);
+      widePlanes.emplace_back(difference ? planeA.getWidth() : 0,
+                              difference ? planeA.getHeight() : 0);
+      channels.push_back(compareChannels(planeA, planeB, a.getMaxLuminocity(),
+                                         difference ? &widePlanes.back() : nullptr));
+    } else {
+      Plane planeA = a.getChannel(c);
+      Plane planeB = b.getChannel(c);
+      planes.emplace_back(difference ? planeA.getWidth() : 0,
+                          difference ? planeA.getHeight() : 0);
+      channels.push_back(compareChannels(planeA, planeB, a.getMaxLuminocity(),
+                                         difference ? &planes.back() : nullptr));
+    }
+  }
+  if (difference && a.isWide()) {
+    difference->setWideChannels(widePlanes);
+  } else if (difference) {
+    difference->setChannels(planes);
+  }
+  return channels;
+}
+
+// One line per channel, then one for the whole image when it has several.
+// PSNR is measured against the image's maxval.
+void printComparison(std::ostream &out, const Image &image,
+                     const std::vector<ChannelComparison> &channels) {
+  const double samples = static_cast<double>(image.getWidth()) * image.getHeight();
+  const double peak = image.getMaxLuminocity();
+  auto print = [&](const std::string &name, const ChannelComparison &c,
+                   double count) {
+    double mse = c.squares / count;
+    out << "  " << name << ": max error " << c.maximum << " mse " << mse
+        << " psnr ";
+    if (c.squares == 0) {
+      out << "inf";
+    } else {
+      out << 10 * std::log10(peak * peak / mse);
+    }
+    out << " ssim " << c.ssim << std::endl;
+  };
+
+  ChannelComparison all;
+  all.ssim = 0;
+  for (int c = 0; c < static_cast<int>(channels.size()); c++) {
+    print(channelName(image, c), channels[c], samples);
+    all.maximum = std::max(all.maximum, channels[c].maximum);
+    all.squares += channels[c].squares;
+    all.ssim += channels[c].ssim / channels.size();
+  }
+  if (channels.size() > 1) {
+    print("all", all, samples * channels.size());
+  }
+}
+
+Image &rankFilter(Image &image, int radius, double percentile, EdgeMode edge) {
+  return filterChannels(image, [&](const auto &plane) {
+    return rankFilterPlane(plane, radius, percentile, edge);
+  });
+}
+
+Image &morphology(Image &image, Morphology operation, int w, int h) {
+  return filterChannels(image, [&](const auto &plane) {
+    return morphologyPlane(plane, operation, w, h);
+  });
+}
+
+Image &gradientMagnitude(Image &image, bool scharr, EdgeMode edge) {
+  int maxValue = image.getMaxLuminocity();
+  return filterChannels(image, [&](const auto &plane) {
+    return gradientPlane(plane, scharr, edge, maxValue);
+  });
+}
+
+Image &threshold(Image &image, int level) {
+  int on = image.getMaxLuminocity();
+  return filterChannels(image, [&](const auto &plane) {
+    return thresholdPlane(plane, level, on);
+  });
+}
+
+Image &warp(Image &image, const AffineTransform &transform,
+            Interpolation interpolation, const std::vector<int> &fill) {
+  WarpGeometry geometry =
+      planWarp(image.getWidth(), image.getHeight(), transform);
+  int maxValue = image.getSampleMaximum();
+  std::vector<Plane> planes;
+  std::vector<WidePlane> widePlanes;
+  for (int c = 0; c < image.getChannels(); c++) {
+    int value = clampSample(fill[std::min<size_t>(c, fill.size() - 1)], maxValue);
+    int factorX, factorY;
+    image.getChannelSubsampling(c, factorX, factorY);
+    WarpGeometry channelGeometry = subsampleWarp(geometry, factorX, factorY);
+    if (image.isWide()) {
+      widePlanes.push_back(warpPlane(image.getWideChannel(c), channelGeometry,
+                                     interpolation, static_cast<uint16_t>(value),
+                                     maxValue));
+    } else {
+      planes.push_back(warpPlane(image.getChannel(c), channelGeometry,
+                                 interpolation, static_cast<unsigned char>(value),
+                                 maxValue));
+    }
+  }
+  if (!commitResult()) {
+    return image;
   }
+  if (image.isWide()) {
+    image.setWideChannels(widePlanes);
+  } else {
+    image.setChannels(planes);
+  }
+  return image;
+}
+
+enum class VideoFormat { I420, NV12 };
+
+bool parseVideoFormat(const std::string &name, VideoFormat &format) {
+  if (name == "i420") {
+    format = VideoFormat::I420;
+  } else if (name == "nv12") {
+    format = VideoFormat::NV12;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// One step of the per-frame chain, named after the image command it runs:
+// z, m, n, r <times> or s <factor>.
+struct VideoOperation {
+  std::string command;
+  double value;
 };
 
-RGBImage::RGBImage(const GSCImage &gscImage) {
-  width = gscImage.getWidth();
-  height = gscImage.getHeight();
+// Size of one raw 4:2:0 frame: a full Y plane and two quarter-size chroma
+// planes, stored one after the other (I420) or interleaved UVUV... (NV12).
+size_t videoFrameBytes(int width, int height) {
+  size_t chroma = static_cast<size_t>((width + 1) / 2) * ((height + 1) / 2);
+  return static_cast<size_t>(width) * height + 2 * chroma;
+}
+
+void unpackVideoFrame(const std::vector<unsigned char> &data, VideoFormat format,
+                      int width, int height, YUVImage &image) {
+  if (image.getWidth() != width || image.getHeight() != height) {
+    image = YUVImage(width, height, ChromaSubsampling::Yuv420);
+  }
+  image.invalidateCaches();
+
+  const unsigned char *source = data.data();
+  Plane &luma = image.getPlane(0);
+  for (int i = 0; i < height; i++, source += width) {
+    std::memcpy(luma.row(i), source, width);
+  }
+
+  Plane &u = image.getPlane(1);
+  Plane &v = image.getPlane(2);
+  int chromaWidth = u.getWidth();
+  if (format == VideoFormat::I420) {
+    for (int i = 0; i < u.getHeight(); i++, source += chromaWidth) {
+      std::memcpy(u.row(i), source, chromaWidth);
+    }
+    for (int i = 0; i < v.getHeight(); i++, source += chromaWidth) {
+      std::memcpy(v.row(i), source, chromaWidth);
+    }
+  } else {
+    for (int i = 0; i < u.getHeight(); i++) {
+      unsigned char *uRow = u.row(i);
+      unsigned char *vRow = v.row(i);
+      for (int j = 0; j < chromaWidth; j++) {
+        uRow[j] = *source++;
+        vRow[j] = *source++;
+      }
+    }
+  }
+}
+
+void packVideoFrame(const YUVImage &image, VideoFormat format,
+                    std::vector<unsigned char> &data) {
+  int width = image.getWidth();
+  int height = image.getHeight();
+  data.resize(videoFrameBytes(width, height));
+
+  unsigned char *target = data.data();
+  const Plane &luma = image.getPlane(0);
+  for (int i = 0; i < height; i++, target += width) {
+    std::memcpy(target, luma.row(i), width);
+  }
+
+  const Plane &u = image.getPlane(1);
+  const Plane &v = image.getPlane(2);
+  int chromaWidth = u.getWidth();
+  if (format == VideoFormat::I420) {
+    for (int i = 0; i < u.getHeight(); i++, target += chromaWidth) {
+      std::memcpy(target, u.row(i), chromaWidth);
+    }
+    for (int i = 0; i < v.getHeight(); i++, target += chromaWidth) {
+      std::memcpy(target, v.row(i), chromaWidth);
+    }
+  } else {
+    for (int i = 0; i < u.getHeight(); i++) {
+      const unsigned char *uRow = u.row(i);
+      const unsigned char *vRow = v.row(i);
+      for (int j = 0; j < chromaWidth; j++) {
+        *target++ = uRow[j];
+        *target++ = vRow[j];
+      }
+    }
+  }
+}
+
+// Blocking FIFO between two pipeline stages. pop() returns false once the
+// queue has been closed and drained.
+template <typename T> class FrameQueue {
+private:
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<T> items;
+  bool closed = false;
+
+public:
+  void push(T item) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      items.push_back(std::move(item));
+    }
+    ready.notify_one();
+  }
+
+  bool pop(T &item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    ready.wait(lock, [this] { return !items.empty() || closed; });
+    if (items.empty()) {
+      return false;
+    }
+    item = std::move(items.front());
+    items.pop_front();
+    return true;
+  }
+
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+    }
+    ready.notify_all();
+  }
+};
+
+struct VideoFrame {
+  std::vector<unsigned char> data;
+  YUVImage image;
+};
+
+struct VideoResult {
+  int framesRead;
+  int framesWritten;
+  int width;
+  int height;
+};
+
+// Streams `frames` raw 4:2:0 frames from `input` through `operations` into
+// `output`. A reader, a worker and a writer thread overlap I/O with
+// processing; they pass frames from a fixed pool of videoPoolSize buffers,
+// so memory does not grow with the length of the video. Stops early at the
+// end of the input.
+const int videoPoolSize = 4;
+
+VideoResult processVideo(std::istream &input, std::ostream &output,
+                         VideoFormat format, int width, int height, int frames,
+                         const std::vector<VideoOperation> &operations) {
+  VideoResult result = {0, 0, width, height};
+  FrameQueue<std::unique_ptr<VideoFrame>> free, decoded, processed;
+  for (int k = 0; k < videoPoolSize; k++) {
+    free.push(std::unique_ptr<VideoFrame>(new VideoFrame()));
+  }
+
+  std::thread reader([&] {
+    size_t bytes = videoFrameBytes(width, height);
+    std::unique_ptr<VideoFrame> frame;
+    for (int k = 0; k < frames && free.pop(frame); k++) {
+      frame->data.resize(bytes);
+      if (!input.read(reinterpret_cast<char *>(frame->data.data()), bytes)) {
+        break;
+      }
+      result.framesRead++;
+      decoded.push(std::move(frame));
+    }
+    decoded.close();
+  });
+
+  std::thread worker([&] {
+    std::unique_ptr<VideoFrame> frame;
+    while (decoded.pop(frame)) {
+      unpackVideoFrame(frame->data, format, width, height, frame->image);
+      for (const VideoOperation &operation : operations) {
+        if (operation.command == "z") {
+          histogramEqualization(frame->image);
+        } else if (operation.command == "m") {
+          mirrorVertical(frame->image);
+        } else if (operation.command == "n") {
+          reverseBrightness(frame->image);
+        } else if (operation.command == "r") {
+          rotate(frame->image, static_cast<int>(operation.value));
+        } else if (operation.command == "s") {
+          resize(frame->image, operation.value);
+        }
+      }
+      packVideoFrame(frame->image, format, frame->data);
+      processed.push(std::move(frame));
+    }
+    processed.close();
+  });
+
+  std::thread writer([&] {
+    std::unique_ptr<VideoFrame> frame;
+    while (processed.pop(frame)) {
+      if (output.write(reinterpret_cast<const char *>(frame->data.data()),
+                       frame->data.size())) {
+        result.framesWritten++;
+        result.width = frame->image.getWidth();
+        result.height = frame->image.getHeight();
+      }
+      free.push(std::move(frame));
+    }
+  });
+
+  reader.join();
+  worker.join();
+  writer.join();
+  return result;
+}
+
+std::vector<std::string> splitCommand(const std::string &line) {
+  std::istringstream iss(line);
+  return std::vector<std::string>{std::istream_iterator<std::string>{iss},
+                                  std::istream_iterator<std::string>{}};
+}
+
+bool executeCommand(const std::vector<std::string> &tokens,
+                    TokenDatabase &database, std::ostream &out);
+
+// Part of every result cache key. Bump it whenever a command or an export
+// format starts producing different bytes, so entries written by older
+// builds are no longer found and age out of the cache.
+const int resultCacheVersion = 1;
+
+// Cache entry for exporting an image with `history` in `format`.
+std::string resultCacheKey(const std::string &history, const std::string &format) {
+  std::string chain = std::to_string(resultCacheVersion) + "\n" + history +
+                      "\n" + format;
+  return history.substr(0, 16) + "-" +
+         hashString(contentHash(chain.data(), chain.size()));
+}
+
+// The token a command works on, which orders it against background jobs on
+// the same token; empty for commands that work on none.
+std::string commandToken(const std::vector<std::string> &tokens) {
+  const std::string &command = tokens[0];
+  if (command == "i") {
+    return tokens.size() >= 4 ? tokens[3] : "";
+  }
+  if (command == "q" || command == "video" || command == "cache" ||
+      command == "jobs" || command == "wait" || command == "cancel") {
+    return "";
+  }
+  return tokens.size() >= 2 ? tokens[1] : "";
+}
+
+// Records a command on a deferred token without decoding it. Only commands
+// whose reply depends on nothing but their arguments and the kind of image
+// qualify; they print the same reply they would have printed. Returns false
+// for every other command.
+bool deferOperation(Token &token, const std::vector<std::string> &tokens,
+                    std::ostream &out) {
+  DeferredImport &deferred = *token.getDeferred();
+  const std::string &command = tokens[0];
+  const std::string &name = tokens[1];
+  if (command == "r" && tokens.size() >= 4 && tokens[2] == "clockwise") {
+    std::stoi(tokens[3]);
+    out << "[OK] Rotate " << name << std::endl;
+  } else if (command == "s" && tokens.size() >= 4) {
+    std::stod(tokens[3]);
+    out << "[OK] Scale " << name << std::endl;
+  } else if (command == "m") {
+    out << "[OK] Mirror " << name << std::endl;
+  } else if (command == "n") {
+    out << "[OK] Color Inversion " << name << std::endl;
+  } else if (command == "z") {
+    out << "[OK] Equalize " << name << std::endl;
+  } else if (command == "g") {
+    if (deferred.kind == ImageKind::Grayscale) {
+      out << "[NOP] Already grayscale " << name << std::endl;
+      return true;
+    }
+    deferred.kind = ImageKind::Grayscale;
+    out << "[OK] Grayscale " << name << std::endl;
+  } else if (command == "rgb") {
+    if (deferred.kind == ImageKind::RGB) {
+      out << "[NOP] Already RGB " << name << std::endl;
+      return true;
+    }
+    deferred.kind = ImageKind::RGB;
+    out << "[OK] RGB " << name << std::endl;
+  } else if (command == "yuv" && tokens.size() >= 3) {
+    ChromaSubsampling subsampling;
+    if (!parseChromaSubsampling(tokens[2], subsampling)) {
+      return false;
+    }
+    deferred.kind = ImageKind::YUV;
+    out << "[OK] YUV " << tokens[2] << " " << name << std::endl;
+  } else {
+    return false;
+  }
+  deferred.operations.push_back(tokens);
+  return true;
+}
+
+// Decodes a deferred token's file, which must still hold the content it had
+// at import, and replays the recorded commands through executeCommand on a
+// private database, so they behave exactly as if they had run at the time.
+bool materializeToken(Token &token, std::ostream &out) {
+  const DeferredImport &deferred = *token.getDeferred();
+  MappedFile mapped(deferred.filename.c_str());
+  if (!mapped.isOpen()) {
+    out << "[ERROR] Unable to open " << deferred.filename << std::endl;
+    return false;
+  }
+  Image *image = nullptr;
+  if (hashString(contentHash(mapped.begin(), mapped.end() - mapped.begin())) ==
+      deferred.source) {
+    image = deferred.shrink.isSet() ? readNetpbmTextShrunk(mapped, deferred.shrink)
+                                    : readNetpbmText(mapped);
+  }
+  if (image == nullptr) {
+    out << "[ERROR] " << deferred.filename << " changed since import"
+        << std::endl;
+    return false;
+  }
+
+  TokenDatabase replay;
+  replay.tokens.push_back(Token(token.getName(), image));
+  std::ostringstream replies;
+  for (const std::vector<std::string> &operation : deferred.operations) {
+    executeCommand(operation, replay, replies);
+  }
+  // Decoding is cut short too when a job is cancelled
+  if (!commitResult()) {
+    replay.tokens[0].releaseImage();
+    return false;
+  }
+  token.setPtr(replay.tokens[0].getPtr());
+  token.setDeferred(nullptr);
+  return true;
+}
+
+// Runs one command line against `database` and writes its replies to `out`.
+// Returns false for `q`. Every command but i, d, q and video works on the
+// token named by tokens[1], which stays locked for the whole command: shared
+// for the commands that only read the image (e, stats, histogram, region) and
+// exclusively for the rest. Commands on different tokens, and reads of the
+// same token, can therefore run at the same time. Token locks are only taken
+// while the database is held shared, so import and delete, which hold it
+// exclusively, never wait on a token.
+//
+// A line ending in `&` is queued as a background job instead (see JobQueue);
+// other commands first wait for the jobs on their token.
+//
+// Before a command changes the token's image, the command is added to the
+// token's history and a shared image is copied. Deferred tokens record the
+// commands deferOperation() allows and decode for the rest; `e` decodes
+// only when the result cache misses.
+bool executeCommand(const std::vector<std::string> &tokens,
+                    TokenDatabase &database, std::ostream &out) {
+  int afterEq = 0;
+
+  const std::string &command = tokens[0];
+  if (tokens.size() >= 2 && tokens.back() == "&") {
+    std::vector<std::string> job(tokens.begin(), tokens.end() - 1);
+    if (command == "q" || command == "jobs" || command == "wait" ||
+        command == "cancel") {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
+    int id = database.jobs.submit(
+        job, commandToken(job),
+        [&database](const std::vector<std::string> &line, std::ostream &replies) {
+          executeCommand(line, database, replies);
+        });
+    out << "[OK] Job " << id << std::endl;
+    return true;
+  }
+  if (!runningJob) {
+    database.jobs.waitForToken(commandToken(tokens));
+  }
+
+  std::shared_lock<std::shared_mutex> databaseLock;
+  std::shared_lock<std::shared_mutex> readLock;
+  std::unique_lock<std::shared_mutex> writeLock;
+  // Declared after the locks so that an interrupted command is undone
+  // before the token is unlocked
+  InterruptibleCommand interruptible;
+  if (command != "i" && command != "d" && command != "q" &&
+      command != "video" && command != "cache" && command != "jobs" &&
+      command != "wait" && command != "cancel" && command != "compare") {
+    databaseLock = std::shared_lock<std::shared_mutex>(database.mutex);
+    Token *locked =
+        tokens.size() >= 2 ? findToken(database.tokens, tokens[1]) : nullptr;
+    if (locked && (command == "e" || command == "stats" ||
+                   command == "histogram" || command == "region")) {
+      readLock = std::shared_lock<std::shared_mutex>(locked->getLock());
+      // Decoding a deferred token changes it, so that needs it to itself
+      if (locked->isDeferred()) {
+        readLock.unlock();
+        writeLock = std::unique_lock<std::shared_mutex>(locked->getLock());
+      }
+    } else if (locked) {
+      writeLock = std::unique_lock<std::shared_mutex>(locked->getLock());
+      // Only the outermost command of a job; commands materializeToken()
+      // replays inside it are undone with it
+      if (runningJob && !cancellation) {
+        interruptible.begin(*locked, *runningJob);
+      }
+      locked->recordOperation(tokens);
+      if (locked->isDeferred() && deferOperation(*locked, tokens, out)) {
+        return true;
+      }
+      locked->unshare();
+      // Pyramid levels only stay valid across scaling
+      if (command != "s" && locked->getPyramid()) {
+        locked->getPyramid()->reset();
+      }
+    }
+    if (locked && locked->isDeferred() && command != "e" &&
+        !materializeToken(*locked, out)) {
+      return true;
+    }
+  }
+
+  if (tokens[0] == "i" && tokens.size() >= 4) {
+    std::string filename = tokens[1];
+    std::string token = tokens[3];
+
+    if (token[0] != '$') {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
+
+    // `scale <f>` and `max <n>` shrink the image while it is decoded
+    ShrinkTarget shrink;
+    bool valid = true;
+    if (tokens.size() >= 5 && tokens[4] == "scale") {
+      shrink.scale = tokens.size() >= 6 ? std::stod(tokens[5]) : 0;
+      valid = shrink.scale > 0 && shrink.scale <= 1;
+    } else if (tokens.size() >= 5 && tokens[4] == "max") {
+      shrink.maxSide = tokens.size() >= 6 ? std::stoi(tokens[5]) : 0;
+      valid = shrink.maxSide > 0;
+    }
+    if (!valid) {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
+
+    {
+      std::shared_lock<std::shared_mutex> lock(database.mutex);
+      if (tokenExists(database.tokens, token)) {
+        out << "[ERROR] Token " << token << " exists" << std::endl;
+        return true;
+      }
+    }
+
+    // The content hash names the input in the result cache and finds
+    // earlier imports of the same content, which share their image
+    MappedFile mapped(filename.c_str());
+    Token imported(token);
+    std::string source;
+    if (mapped.isOpen()) {
+      source = hashString(contentHash(mapped.begin(), mapped.end() - mapped.begin()));
+      // A shrunk import is a different starting image of the same content
+      imported.setHistory(shrink.isSet()
+                              ? source + "\ni " + tokens[4] + " " + tokens[5]
+                              : source);
+      std::unique_lock<std::shared_mutex> lock(database.mutex);
+      auto twin = std::find_if(
+          database.tokens.begin(), database.tokens.end(), [&](const Token &other) {
+            return other.getHistory() == imported.getHistory();
+          });
+      if (twin != database.tokens.end() && !tokenExists(database.tokens, token)) {
+        if (twin->isDeferred()) {
+          imported.setDeferred(std::make_shared<DeferredImport>(*twin->getDeferred()));
+        } else {
+          imported.shareImage(*twin);
+        }
+        database.tokens.push_back(imported);
+        out << "[OK] Import " << token << std::endl;
+        return true;
+      }
+    }
+
+    // With cached results for this content, decoding waits until something
+    // needs the pixels. Otherwise it runs unlocked; another client may take
+    // the name meanwhile.
+    NetpbmHeader header;
+    if (mapped.isOpen() && parseNetpbmHeader(mapped, header) &&
+        database.cache.hasSource(source)) {
+      imported.setDeferred(std::make_shared<DeferredImport>(DeferredImport{
+          filename, source,
+          header.channels == 3 ? ImageKind::RGB : ImageKind::Grayscale, {},
+          shrink}));
+    } else {
+      Image *img = nullptr;
+      if (mapped.isOpen()) {
+        img = shrink.isSet() ? readNetpbmTextShrunk(mapped, shrink)
+                             : readNetpbmText(mapped);
+      }
+      if (img == nullptr) {
+        img = readNetpbmImage(filename.c_str(), out);
+        if (img != nullptr && shrink.isSet()) {
+          shrinkImage(*img, shrink);
+        }
+      }
+      if (img == nullptr) {
+        return true;
+      }
+      imported.setPtr(img);
+    }
+
+    std::unique_lock<std::shared_mutex> lock(database.mutex);
+    if (tokenExists(database.tokens, token)) {
+      imported.releaseImage();
+      out << "[ERROR] Token " << token << " exists" << std::endl;
+      return true;
+    }
+    database.tokens.push_back(imported);
+    out << "[OK] Import " << token << std::endl;
+  } else if (tokens[0] == "r" && tokens.size() >= 4 && tokens[2] == "clockwise") {
+    std::string token = tokens[1];
+
+    if (token[0] != '$') {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
+
+    Token *tokenPtr = findToken(database.tokens, token);
+    if (tokenPtr == nullptr) {
+      out << "[ERROR] Token " << token << " not found!" << std::endl;
+      return true;
+    }
+
+    int times = std::stoi(tokens[3]);
+
+    Image *imagePtr = tokenPtr->getPtr();
+    *imagePtr = rotate(*imagePtr, times);
+    out << "[OK] Rotate " << token << std::endl;
+  } else if (tokens[0] == "s" && tokens.size() >= 4) {
+    std::string token = tokens[1];
+
+    if (token[0] != '$') {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
+
+    Token *tokenPtr = findToken(database.tokens, token);
+    if (tokenPtr == nullptr) {
+      out << "[ERROR] Token " << token << " not found!" << std::endl;
+      return true;
+    }
+
+    double factor = std::stod(tokens[3]);
+
+    Image *imagePtr = tokenPtr->getPtr();
+    int newWidth = static_cast<int>(imagePtr->getWidth() * factor);
+    int newHeight = static_cast<int>(imagePtr->getHeight() * factor);
+    if (tokenPtr->getPyramid() && newWidth > 0 && newHeight > 0) {
+      Image *scaled = tokenPtr->getPyramid()->scale(*imagePtr, newWidth, newHeight);
+      if (commitResult()) {
+        tokenPtr->setPtr(scaled);
+        delete imagePtr;
+      } else {
+        delete scaled;
+      }
+    } else {
+      *imagePtr = resize(*imagePtr, factor);
+    }
+    out << "[OK] Scale " << token << std::endl;
+  } else if (tokens[0] == "g" && tokens.size() >= 2) {
+    std::string token = tokens[1];
+
+    if (token[0] != '$') {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
+
+    Token *tokenPtr = findToken(database.tokens, token);
+    if (tokenPtr == nullptr) {
+      out << "[ERROR] Token " << token << " not found!" << std::endl;
+      return true;
+    }
+
+    CancellationPause pause;
+    Image *imagePtr = tokenPtr->getPtr();
+    if (dynamic_cast<GSCImage *>(imagePtr)) {
+      out << "[NOP] Already grayscale " << token << std::endl;
+    } else if (dynamic_cast<RGBImage *>(imagePtr)) {
+      RGBImage *rgbImage = static_cast<RGBImage *>(imagePtr);
+      GSCImage *gscImage = new GSCImage(*rgbImage);
+      delete rgbImage;
+      tokenPtr->setPtr(gscImage);
+      out << "[OK] Grayscale " << token << std::endl;
+    } else if (dynamic_cast<YUVImage *>(imagePtr)) {
+      RGBImage *rgbImage = new RGBImage(*static_cast<YUVImage *>(imagePtr));
+      GSCImage *gscImage = new GSCImage(*rgbImage);
+      delete rgbImage;
+      tokenPtr->setPtr(gscImage);
+      out << "[OK] Grayscale " << token << std::endl;
+    }
+  }
+  else if (tokens[0] == "m" && tokens.size() >= 2) {
+    std::string token = tokens[1];
+
+    if (token[0] != '$') {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
+
+    Token *tokenPtr = findToken(database.tokens, token);
+    if (tokenPtr == nullptr) {
+      out << "[ERROR] Token " << token << " not found!" << std::endl;
+      return true;
+    }
+
+    Image *imagePtr = tokenPtr->getPtr();
+    *imagePtr = mirrorVertical(*imagePtr);
+    out << "[OK] Mirror " << token << std::endl;
+  }
+  if (tokens[0] == "n" && tokens.size() >= 2) {
+    std::string token = tokens[1];
+
+    if (token[0] != '$') {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
+
+    Token *tokenPtr = findToken(database.tokens, token);
+    if (tokenPtr == nullptr) {
+      out << "[ERROR] Token " << token << " not found!" << std::endl;
+      return true;
+    }
+
+    Image *imagePtr = tokenPtr->getPtr();
+    *imagePtr = reverseBrightness(*imagePtr);
+    out << "[OK] Color Inversion " << token << std::endl;
+  } else if (tokens[0] == "d") {
+    std::string token = tokens[1];
+    std::unique_lock<std::shared_mutex> lock(database.mutex);
+    deleteToken(database.tokens, token, out);
+  } else if (tokens[0] == "q") {
+    return false;
+  } else if (tokens[0] == "z" && tokens.size() >= 2) {
+    std::string token = tokens[1];
+
+    if (token[0] != '$') {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
+
+    Token *tokenPtr = findToken(database.tokens, token);
+    if (tokenPtr == nullptr) {
+      out << "[ERROR] Token " << token << " not found!" << std::endl;
+      return true;
+    }
+
+    // 16-bit images are equalized in place so they keep their depth
+    Image *imagePtr = tokenPtr->getPtr();
+    if (imagePtr->isWide()) {
+      histogramEqualization(*imagePtr);
+      out << "[OK] Equalize " << token << std::endl;
+    } else if (dynamic_cast<GSCImage *>(imagePtr)) {
+      CancellationPause pause;
+      GSCImage *gscImage = static_cast<GSCImage *>(imagePtr);
+		RGBImage *rgbImage = new RGBImage(*gscImage);
+      histogramEqualization(*rgbImage);
+		GSCImage *gscImage2 = new GSCImage(*rgbImage,afterEq);
+		delete rgbImage;
+		tokenPtr->setPtr(gscImage2);
+      out << "[OK] Equalize " << token << std::endl;
+    } else if (dynamic_cast<RGBImage *>(imagePtr)) {
+      histogramEqualization(*imagePtr);
+      out << "[OK] Equalize " << token << std::endl;
+    } else if (dynamic_cast<YUVImage *>(imagePtr)) {
+      histogramEqualization(*imagePtr);
+      out << "[OK] Equalize " << token << std::endl;
+    }
+  } else if (tokens[0] == "video" && tokens.size() >= 7) {
+    std::string inputName = tokens[1];
+    std::string outputName = tokens[2];
+
+    VideoFormat format;
+    if (!parseVideoFormat(tokens[3], format)) {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
+
+    int width = std::stoi(tokens[4]);
+    int height = std::stoi(tokens[5]);
+    int frames = std::stoi(tokens[6]);
+    if (width <= 0 || height <= 0 || frames <= 0) {
+      out << "[ERROR] Invalid frame size or count" << std::endl;
+      return true;
+    }
+
+    std::vector<VideoOperation> operations;
+    bool valid = true;
+    for (size_t next = 7; next < tokens.size() && valid; next++) {
+      VideoOperation operation = {tokens[next], 0.0};
+      if (operation.command == "r" || operation.command == "s") {
+        if (next + 1 >= tokens.size()) {
+          valid = false;
+          break;
+        }
+        operation.value = std::stod(tokens[++next]);
+        if (operation.command == "s" && operation.value <= 0) {
+          valid = false;
+        }
+      } else if (operation.command != "z" && operation.command != "m" &&
+                 operation.command != "n") {
+        valid = false;
+      }
+      operations.push_back(operation);
+    }
+    if (!valid) {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
+
+    std::ifstream input(inputName, std::ios::binary);
+    if (!input.is_open()) {
+      out << "[ERROR] Unable to open file" << std::endl;
+      return true;
+    }
+
+    if (fileExists(outputName)) {
+      out << "[ERROR] File exists" << std::endl;
+      return true;
+    }
+
+    std::ofstream output(outputName, std::ios::binary);
+    if (!output.is_open()) {
+      out << "[ERROR] Unable to create file" << std::endl;
+      return true;
+    }
+
+    VideoResult result = processVideo(input, output, format, width, height,
+                                      frames, operations);
+    if (result.framesWritten < result.framesRead) {
+      out << "[ERROR] Unable to write to file" << std::endl;
+      return true;
+    }
+    if (result.framesRead < frames) {
+      out << "[ERROR] Input ends after " << result.framesRead << " frames"
+          << std::endl;
+    }
+    out << "[OK] Video " << result.framesWritten << " frames " << result.width
+        << "x" << result.height << " " << outputName << std::endl;
+  } else if (tokens[0] == "yuv" && tokens.size() >= 3) {
+    std::string token = tokens[1];
+
+    if (token[0] != '$') {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
+
+    Token *tokenPtr = findToken(database.tokens, token);
+    if (tokenPtr == nullptr) {
+      out << "[ERROR] Token " << token << " not found!" << std::endl;
+      return true;
+    }
+
+    ChromaSubsampling subsampling;
+    if (!parseChromaSubsampling(tokens[2], subsampling)) {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
+
+    // The RGBImage conversions consume their source image
+    CancellationPause pause;
+    Image *imagePtr = tokenPtr->getPtr();
+    RGBImage *rgbImage = nullptr;
+    if (dynamic_cast<GSCImage *>(imagePtr)) {
+      rgbImage = new RGBImage(*static_cast<GSCImage *>(imagePtr));
+    } else if (dynamic_cast<YUVImage *>(imagePtr)) {
+      rgbImage = new RGBImage(*static_cast<YUVImage *>(imagePtr));
+    } else {
+      rgbImage = static_cast<RGBImage *>(imagePtr);
+    }
+    tokenPtr->setPtr(new YUVImage(*rgbImage, subsampling));
+    delete rgbImage;
+    out << "[OK] YUV " << tokens[2] << " " << token << std::endl;
+  } else if (tokens[0] == "rgb" && tokens.size() >= 2) {
+    std::string token = tokens[1];
+
+    if (token[0] != '$') {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
+
+    Token *tokenPtr = findToken(database.tokens, token);
+    if (tokenPtr == nullptr) {
+      out << "[ERROR] Token " << token << " not found!" << std::endl;
+      return true;
+    }
+
+    CancellationPause pause;
+    Image *imagePtr = tokenPtr->getPtr();
+    if (dynamic_cast<RGBImage *>(imagePtr)) {
+      out << "[NOP] Already RGB " << token << std::endl;
+      return true;
+    } else if (dynamic_cast<GSCImage *>(imagePtr)) {
+      tokenPtr->setPtr(new RGBImage(*static_cast<GSCImage *>(imagePtr)));
+    } else {
+      tokenPtr->setPtr(new RGBImage(*static_cast<YUVImage *>(imagePtr)));
+    }
+    out << "[OK] RGB " << token << std::endl;
+  } else if (tokens[0] == "warp" && tokens.size() >= 4) {
+    std::string token = tokens[1];
+
+    if (token[0] != '$') {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
+
+    Token *tokenPtr = findToken(database.tokens, token);
+    if (tokenPtr == nullptr) {
+      out << "[ERROR] Token " << token << " not found!" << std::endl;
+      return true;
+    }
+
+    AffineTransform transform;
+    size_t next;
+    if (tokens[2] == "rotate") {
+      transform = AffineTransform::rotation(std::stod(tokens[3]));
+      next = 4;
+    } else if (tokens[2] == "shear" && tokens.size() >= 5) {
+      transform =
+          AffineTransform::shear(std::stod(tokens[3]), std::stod(tokens[4]));
+      next = 5;
+    } else if (tokens[2] == "affine" && tokens.size() >= 7) {
+      transform = {std::stod(tokens[3]), std::stod(tokens[4]),
+                   std::stod(tokens[5]), std::stod(tokens[6])};
+      next = 7;
+    } else {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
+
+    if (!transform.isFinite() || std::fabs(transform.determinant()) < 1e-9) {
+      out << "[ERROR] Transform is not invertible" << std::endl;
+      return true;
+    }
+    if (!warpFits(tokenPtr->getPtr()->getWidth(), tokenPtr->getPtr()->getHeight(),
+                  transform)) {
+      out << "[ERROR] Warped image too large" << std::endl;
+      return true;
+    }
+
+    Interpolation interpolation = Interpolation::Bilinear;
+    std::vector<int> fill;
+    for (; next < tokens.size(); next++) {
+      if (tokens[next] == "bicubic") {
+        interpolation = Interpolation::Bicubic;
+      } else if (tokens[next] == "bilinear") {
+        interpolation = Interpolation::Bilinear;
+      } else if (tokens[next] == "fill") {
+        fill.clear();
+        while (next + 1 < tokens.size() && fill.size() < 3 &&
+               std::isdigit(static_cast<unsigned char>(tokens[next + 1][0]))) {
+          fill.push_back(std::stoi(tokens[++next]));
+        }
+      }
+    }
+
+    // Fill values are in the image's own channels, black by default
+    Image *imagePtr = tokenPtr->getPtr();
+    if (fill.empty()) {
+      fill = dynamic_cast<YUVImage *>(imagePtr) ? std::vector<int>{16, 128, 128}
+                                                : std::vector<int>{0};
+    }
+    warp(*imagePtr, transform, interpolation, fill);
+    out << "[OK] Warp " << token << std::endl;
+  } else if (tokens[0] == "blur" && tokens.size() >= 4) {
+    std::string token = tokens[1];
+
+    if (token[0] != '$') {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
 
-  pixels = new RGBPixel *[height];
-  for (int i = 0; i < height; i++) {
-    pixels[i] = new RGBPixel[width];
-    for (int j = 0; j < width; j++) {
-      const Pixel &pixel = gscImage.getPixel(i, j);
-      const GSCPixel &gscPixel = dynamic_cast<const GSCPixel &>(pixel);
+    Token *tokenPtr = findToken(database.tokens, token);
+    if (tokenPtr == nullptr) {
+      out << "[ERROR] Token " << token << " not found!" << std::endl;
+      return true;
+    }
 
-      int value = static_cast<int>(gscPixel.getValue());
-		
-      unsigned char red = static_cast<unsigned char>(value);
-      unsigned char green = static_cast<unsigned char>(value);
-      unsigned char blue = static_cast<unsigned char>(value);
+    EdgeMode edge = EdgeMode::Clamp;
+    if (tokens.size() >= 5 && !parseEdgeMode(tokens[4], edge)) {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
 
-      pixels[i][j] = RGBPixel(red, green, blue);
+    Image *imagePtr = tokenPtr->getPtr();
+    if (tokens[2] == "gaussian" && std::stod(tokens[3]) > 0 &&
+        std::stod(tokens[3]) <= maxGaussianSigma) {
+      gaussianBlur(*imagePtr, std::stod(tokens[3]), edge);
+    } else if (tokens[2] == "box" && std::stoi(tokens[3]) > 0) {
+      boxBlur(*imagePtr, std::stoi(tokens[3]), edge);
+    } else {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
     }
-  }
+    out << "[OK] Blur " << token << std::endl;
+  } else if (tokens[0] == "sharpen" && tokens.size() >= 4) {
+    std::string token = tokens[1];
 
-  delete &gscImage;
-}
+    if (token[0] != '$') {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
 
-std::ostream &operator<<(std::ostream &out, Image &image) {
-  out << "P2" << std::endl;
-  out << image.getWidth() << " " << image.getHeight() << std::endl;
-  out << image.getMaxLuminocity() << std::endl;
-  for (int i = 0; i < image.getHeight(); i++) {
-    for (int j = 0; j < image.getWidth(); j++) {
-      out << static_cast<int>(
-                 static_cast<GSCPixel &>(image.getPixel(i, j)).getValue())
-          << " ";
+    Token *tokenPtr = findToken(database.tokens, token);
+    if (tokenPtr == nullptr) {
+      out << "[ERROR] Token " << token << " not found!" << std::endl;
+      return true;
     }
-    out << std::endl;
-  }
-  return out;
-}
 
-class Token {
-private:
-  std::string name;
-  Image *ptr;
+    double sigma = std::stod(tokens[2]);
+    double amount = std::stod(tokens[3]);
+    EdgeMode edge = EdgeMode::Clamp;
+    if (!(sigma > 0 && sigma <= maxGaussianSigma) ||
+        (tokens.size() >= 5 && !parseEdgeMode(tokens[4], edge))) {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
 
-public:
-  Token(const std::string &n = "", Image *p = nullptr) : name(n), ptr(p) {}
-  std::string getName() const { return name; }
-  Image *getPtr() const { return ptr; }
-  void setName(const std::string &n) { name = n; }
-  void setPtr(Image *p) { ptr = p; }
-};
+    Image *imagePtr = tokenPtr->getPtr();
+    unsharpMask(*imagePtr, sigma, amount, edge);
+    out << "[OK] Sharpen " << token << std::endl;
+  } else if (tokens[0] == "rank" && tokens.size() >= 4) {
+    std::string token = tokens[1];
 
-Image *readNetpbmImage(const char *filename) {
-  std::ifstream f(filename);
-  if (!f.is_open()) {
-    std::cout << "[ERROR] Unable to open " << filename << std::endl;
-  }
-  Image *img_ptr = nullptr;
-  std::string type;
+    if (token[0] != '$') {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
 
-  if (f.good() && !f.eof())
-    f >> type;
-  if (!type.compare("P3")) {
-    img_ptr = new RGBImage(f);
-  } else if (!type.compare("P2")) {
-    img_ptr = new GSCImage(f);
-  } else if (f.is_open()) {
-    std::cout << "[ERROR] Invalid file format" << std::endl;
-  }
-  return img_ptr;
-}
+    Token *tokenPtr = findToken(database.tokens, token);
+    if (tokenPtr == nullptr) {
+      out << "[ERROR] Token " << token << " not found!" << std::endl;
+      return true;
+    }
 
-bool tokenExists(const std::vector<Token> &tokens,
-                 const std::string &tokenName) {
-  return std::find_if(tokens.begin(), tokens.end(),
-                      [tokenName](const Token &token) {
-                        return token.getName() == tokenName;
-                      }) != tokens.end();
-}
+    double percentile;
+    size_t next = 3;
+    if (tokens[2] == "median") {
+      percentile = 50;
+    } else if (tokens[2] == "min") {
+      percentile = 0;
+    } else if (tokens[2] == "max") {
+      percentile = 100;
+    } else if (tokens[2] == "percentile" && tokens.size() >= 5) {
+      percentile = std::stod(tokens[3]);
+      next = 4;
+    } else {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
 
-Token *findToken(const std::vector<Token> &tokenDatabase,
-                 const std::string &token) {
-  for (const Token &t : tokenDatabase) {
-    if (t.getName() == token) {
-      return const_cast<Token *>(&t);
+    int radius = std::stoi(tokens[next]);
+    EdgeMode edge = EdgeMode::Clamp;
+    if (radius < 1 || percentile < 0 || percentile > 100 ||
+        (tokens.size() > next + 1 && !parseEdgeMode(tokens[next + 1], edge))) {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
     }
-  }
-  return nullptr;
-}
 
-bool fileExists(const std::string &filename) {
-  std::ifstream file(filename);
-  return file.good();
-}
+    Image *imagePtr = tokenPtr->getPtr();
+    rankFilter(*imagePtr, radius, percentile, edge);
+    out << "[OK] Rank " << token << std::endl;
+  } else if (tokens[0] == "morph" && tokens.size() >= 4) {
+    std::string token = tokens[1];
 
-bool exportPGMImage(const GSCImage *image, const std::string &filename) {
-  std::ofstream file(filename);
-  if (!file.is_open()) {
-    std::cout << "[ERROR] Unable to create file\n";
-    return false;
-  }
+    if (token[0] != '$') {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
 
-  int width = image->getWidth();
-  int height = image->getHeight();
+    Token *tokenPtr = findToken(database.tokens, token);
+    if (tokenPtr == nullptr) {
+      out << "[ERROR] Token " << token << " not found!" << std::endl;
+      return true;
+    }
 
-  file << "P2\n";
-  file << width << " " << height << " "
-       << "255\n";
+    Morphology operation;
+    if (tokens[2] == "erode") {
+      operation = Morphology::Erode;
+    } else if (tokens[2] == "dilate") {
+      operation = Morphology::Dilate;
+    } else if (tokens[2] == "open") {
+      operation = Morphology::Open;
+    } else if (tokens[2] == "close") {
+      operation = Morphology::Close;
+    } else {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
 
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      const Pixel &pixel = image->getPixel(y, x);
-      const GSCPixel &gscPixel = dynamic_cast<const GSCPixel &>(pixel);
-      unsigned char luminosity = gscPixel.getValue();
-      file << static_cast<int>(luminosity) << "\n";
+    int w = std::stoi(tokens[3]);
+    int h = tokens.size() >= 5 ? std::stoi(tokens[4]) : w;
+    if (w < 1 || h < 1) {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
     }
-  }
-  return true;
-}
 
-bool exportPPMImage(const RGBImage *image, const std::string &filename) {
-  std::ofstream file(filename);
-  if (!file.is_open()) {
-    std::cout << "[ERROR] Unable to create file\n";
-    return false;
-  }
+    Image *imagePtr = tokenPtr->getPtr();
+    morphology(*imagePtr, operation, w, h);
+    out << "[OK] Morph " << token << std::endl;
+  } else if (tokens[0] == "edges" && tokens.size() >= 3) {
+    std::string token = tokens[1];
 
-  int width = image->getWidth();
-  int height = image->getHeight();
+    if (token[0] != '$') {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
 
-  file << "P3\n";
-  file << width << " " << height << " "
-       << "255\n";
+    Token *tokenPtr = findToken(database.tokens, token);
+    if (tokenPtr == nullptr) {
+      out << "[ERROR] Token " << token << " not found!" << std::endl;
+      return true;
+    }
 
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      const Pixel &pixel = image->getPixel(y, x);
-      const RGBPixel &rgbPixel = dynamic_cast<const RGBPixel &>(pixel);
-      unsigned char red = rgbPixel.getRed();
-      unsigned char green = rgbPixel.getGreen();
-      unsigned char blue = rgbPixel.getBlue();
-      file << static_cast<int>(red) << " " << static_cast<int>(green) << " "
-           << static_cast<int>(blue) << "\n";
+    EdgeMode edge = EdgeMode::Clamp;
+    if ((tokens[2] != "sobel" && tokens[2] != "scharr") ||
+        (tokens.size() >= 4 && !parseEdgeMode(tokens[3], edge))) {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
     }
-  }
-  return true;
-}
 
-bool exportYUVImage(const YUVImage *image, const std::string &filename) {
-  std::ofstream file(filename);
-  if (!file.is_open()) {
-    std::cout << "[ERROR] Unable to create file\n";
-    return false;
-  }
+    Image *imagePtr = tokenPtr->getPtr();
+    gradientMagnitude(*imagePtr, tokens[2] == "scharr", edge);
+    out << "[OK] Edges " << token << std::endl;
+  } else if (tokens[0] == "threshold" && tokens.size() >= 3) {
+    std::string token = tokens[1];
 
-  int width = image->getWidth();
-  int height = image->getHeight();
+    if (token[0] != '$') {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
 
-  file << "P3\n";
-  file << width << " " << height << " "
-       << "255\n";
+    Token *tokenPtr = findToken(database.tokens, token);
+    if (tokenPtr == nullptr) {
+      out << "[ERROR] Token " << token << " not found!" << std::endl;
+      return true;
+    }
 
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      const Pixel &pixel = image->getPixel(y, x);
-      const YUVPixel &yuvPixel = dynamic_cast<const YUVPixel &>(pixel);
-      unsigned char y = yuvPixel.getY();
-      unsigned char u = yuvPixel.getU();
-      unsigned char v = yuvPixel.getV();
-      file << static_cast<int>(y) << " " << static_cast<int>(u) << " "
-           << static_cast<int>(v) << "\n";
+    int level = std::stoi(tokens[2]);
+    if (level < 0) {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
     }
-  }
-  return true;
-}
 
-void deleteToken(std::vector<Token> &tokenDatabase,
-                 const std::string &tokenName) {
-  auto tokenIterator = std::find_if(
-      tokenDatabase.begin(), tokenDatabase.end(),
-      [&](const Token &token) { return token.getName() == tokenName; });
+    Image *imagePtr = tokenPtr->getPtr();
+    threshold(*imagePtr, level);
+    out << "[OK] Threshold " << token << std::endl;
+  } else if (tokens[0] == "stats" && tokens.size() >= 2) {
+    std::string token = tokens[1];
 
-  if (tokenIterator != tokenDatabase.end()) {
-    delete tokenIterator->getPtr();
-    tokenDatabase.erase(tokenIterator);
-    std::cout << "[OK] Delete " << tokenName << std::endl;
-  } else {
-    std::cout << "[ERROR] Token " << tokenName << " not found!" << std::endl;
-  }
-}
+    if (token[0] != '$') {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
 
-Image &rotate(Image &image, int times) { return image += times; }
+    Token *tokenPtr = findToken(database.tokens, token);
+    if (tokenPtr == nullptr) {
+      out << "[ERROR] Token " << token << " not found!" << std::endl;
+      return true;
+    }
 
-Image &resize(Image &image, double factor) { return image *= factor; }
+    Image *imagePtr = tokenPtr->getPtr();
+    out << "[OK] Stats " << token << " " << imagePtr->getWidth() << "x"
+        << imagePtr->getHeight() << std::endl;
+    printRegionStatistics(out, *imagePtr, 0, 0, imagePtr->getWidth(),
+                          imagePtr->getHeight());
+  } else if (tokens[0] == "histogram" && tokens.size() >= 2) {
+    std::string token = tokens[1];
+
+    if (token[0] != '$') {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
 
-Image &mirrorVertical(Image &image) { return *image; }
+    Token *tokenPtr = findToken(database.tokens, token);
+    if (tokenPtr == nullptr) {
+      out << "[ERROR] Token " << token << " not found!" << std::endl;
+      return true;
+    }
 
-Image &reverseBrightness(Image &image) { return !image; }
+    out << "[OK] Histogram " << token << std::endl;
+    printHistogram(out, *tokenPtr->getPtr());
+  } else if (tokens[0] == "region" && tokens.size() >= 6) {
+    std::string token = tokens[1];
 
-Image &histogramEqualization(Image &image) { return ~image; }
+    if (token[0] != '$') {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
 
-int main() {
-  std::vector<Token> tokenDatabase;
-  int afterEq = 0;
+    Token *tokenPtr = findToken(database.tokens, token);
+    if (tokenPtr == nullptr) {
+      out << "[ERROR] Token " << token << " not found!" << std::endl;
+      return true;
+    }
 
-  while (true) {
-    std::string line;
-    std::getline(std::cin, line);
+    Image *imagePtr = tokenPtr->getPtr();
+    int x = std::stoi(tokens[2]);
+    int y = std::stoi(tokens[3]);
+    int w = std::stoi(tokens[4]);
+    int h = std::stoi(tokens[5]);
+    if (x < 0 || y < 0 || w < 1 || h < 1 || x + w > imagePtr->getWidth() ||
+        y + h > imagePtr->getHeight()) {
+      out << "[ERROR] Region outside of " << token << std::endl;
+      return true;
+    }
 
-    std::istringstream iss(line);
-    std::vector<std::string> tokens{std::istream_iterator<std::string>{iss},
-                                    std::istream_iterator<std::string>{}};
+    out << "[OK] Region " << token << std::endl;
+    printRegionStatistics(out, *imagePtr, x, y, w, h);
+  } else if (tokens[0] == "pyramid" && tokens.size() >= 3) {
+    std::string token = tokens[1];
 
-    if (tokens.empty()) {
-      continue;
+    if (token[0] != '$') {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
     }
 
-    if (tokens[0] == "i" && tokens.size() >= 4) {
-      std::string filename = tokens[1];
-      std::string token = tokens[3];
+    Token *tokenPtr = findToken(database.tokens, token);
+    if (tokenPtr == nullptr) {
+      out << "[ERROR] Token " << token << " not found!" << std::endl;
+      return true;
+    }
 
-      if (token[0] != '$') {
-        std::cout << "\n-- Invalid command! --" << std::endl;
-        continue;
+    if (tokens[2] == "on") {
+      if (!tokenPtr->getPyramid()) {
+        tokenPtr->setPyramid(std::make_shared<ImagePyramid>());
       }
+    } else if (tokens[2] == "off") {
+      tokenPtr->setPyramid(nullptr);
+    } else {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
+    out << "[OK] Pyramid " << token << " " << tokens[2] << std::endl;
+  } else if (tokens[0] == "compare" && tokens.size() >= 3) {
+    std::string token = tokens[1];
+    std::string reference = tokens[2];
+    std::string differenceToken = tokens.size() >= 5 ? tokens[4] : "";
+
+    if (token[0] != '$' ||
+        (tokens.size() >= 4 && (tokens[3] != "diff" || differenceToken.empty() ||
+                                differenceToken[0] != '$'))) {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
 
-      if (tokenExists(tokenDatabase, token)) {
-        std::cout << "[ERROR] Token " << token << " exists" << std::endl;
-        continue;
+    // A file is decoded before anything is locked
+    std::unique_ptr<Image> file;
+    if (reference[0] != '$') {
+      MappedFile mapped(reference.c_str());
+      file.reset(mapped.isOpen() ? readNetpbmText(mapped) : nullptr);
+      if (!file) {
+        file.reset(readNetpbmImage(reference.c_str(), out));
+      }
+      if (!file) {
+        return true;
       }
+    } else if (!runningJob) {
+      database.jobs.waitForToken(reference);
+    }
 
-      Image *img = readNetpbmImage(filename.c_str());
+    std::unique_ptr<Image> difference;
+    {
+      std::shared_lock<std::shared_mutex> lock(database.mutex);
+      Token *first = findToken(database.tokens, token);
+      Token *second = file ? nullptr : findToken(database.tokens, reference);
+      if (first == nullptr || (!file && second == nullptr)) {
+        out << "[ERROR] Token " << (first ? reference : token) << " not found!"
+            << std::endl;
+        return true;
+      }
+      if (!differenceToken.empty() && tokenExists(database.tokens, differenceToken)) {
+        out << "[ERROR] Token " << differenceToken << " exists" << std::endl;
+        return true;
+      }
 
-      if (img != nullptr) {
-        tokenDatabase.push_back(Token(token, img));
-        std::cout << "[OK] Import " << token << std::endl;
+      // Two tokens are locked in name order, so that commands comparing the
+      // same pair both ways cannot deadlock. Decoding a deferred token
+      // changes it, so that needs it to itself.
+      std::vector<Token *> locked = {first};
+      if (second && second != first) {
+        locked.push_back(second);
+      }
+      std::sort(locked.begin(), locked.end(), [](const Token *x, const Token *y) {
+        return x->getName() < y->getName();
+      });
+      std::vector<std::shared_lock<std::shared_mutex>> readLocks;
+      std::vector<std::unique_lock<std::shared_mutex>> writeLocks;
+      for (Token *t : locked) {
+        std::shared_lock<std::shared_mutex> read(t->getLock());
+        if (!t->isDeferred()) {
+          readLocks.push_back(std::move(read));
+          continue;
+        }
+        read.unlock();
+        writeLocks.emplace_back(t->getLock());
+        if (t->isDeferred() && !materializeToken(*t, out)) {
+          return true;
+        }
       }
-    } else if (tokens[0] == "r" && tokens.size() >= 4 && tokens[2] == "clockwise") {
-      std::string token = tokens[1];
 
-      if (token[0] != '$') {
-        std::cout << "\n-- Invalid command! --" << std::endl;
-        continue;
+      std::unique_ptr<Image> convertedA, convertedB;
+      const Image &imageB = file ? *file : *second->getPtr();
+      const Image &a = comparableImage(*first->getPtr(), imageB, convertedA);
+      const Image &b = comparableImage(imageB, *first->getPtr(), convertedB);
+      if (a.getWidth() != b.getWidth() || a.getHeight() != b.getHeight()) {
+        out << "[ERROR] Images differ in size" << std::endl;
+        return true;
+      }
+      if (a.getMaxLuminocity() != b.getMaxLuminocity()) {
+        out << "[ERROR] Images differ in maxval" << std::endl;
+        return true;
       }
+      if (!differenceToken.empty()) {
+        difference.reset(cloneImage(&a));
+      }
+      std::vector<ChannelComparison> channels = compareImages(a, b, difference.get());
+      out << "[OK] Compare " << token << " " << reference << std::endl;
+      printComparison(out, a, channels);
+    }
 
-      Token *tokenPtr = findToken(tokenDatabase, token);
-      if (tokenPtr == nullptr) {
-        std::cout << "[ERROR] Token " << token << " not found!" << std::endl;
-        continue;
+    if (difference) {
+      std::unique_lock<std::shared_mutex> lock(database.mutex);
+      if (tokenExists(database.tokens, differenceToken)) {
+        out << "[ERROR] Token " << differenceToken << " exists" << std::endl;
+        return true;
       }
+      database.tokens.push_back(Token(differenceToken, difference.release()));
+      out << "[OK] Difference " << differenceToken << std::endl;
+    }
+  } else if (tokens[0] == "jobs") {
+    out << "[OK] Jobs" << std::endl;
+    database.jobs.list(out);
+  } else if (tokens[0] == "wait") {
+    int id = tokens.size() >= 2 ? std::stoi(tokens[1]) : 0;
+    if (id > 0 && !database.jobs.wait(id, out)) {
+      out << "[ERROR] Job " << id << " not found!" << std::endl;
+    } else if (id <= 0 && !database.jobs.wait(0, out)) {
+      out << "[NOP] No jobs" << std::endl;
+    }
+  } else if (tokens[0] == "cancel" && tokens.size() >= 2) {
+    int id = std::stoi(tokens[1]);
+    if (!database.jobs.cancel(id)) {
+      out << "[ERROR] Job " << id << " not found!" << std::endl;
+      return true;
+    }
+    out << "[OK] Cancel job " << id << std::endl;
+  } else if (tokens[0] == "cache" && tokens.size() >= 2) {
+    if (tokens[1] == "off") {
+      database.cache.close();
+      out << "[OK] Cache off" << std::endl;
+      return true;
+    }
 
-      int times = std::stoi(tokens[3]);
+    double megabytes = tokens.size() >= 3 ? std::stod(tokens[2]) : 1024;
+    if (megabytes < 0) {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
+    if (!database.cache.open(tokens[1], static_cast<uint64_t>(megabytes * 1048576))) {
+      out << "[ERROR] Unable to open cache " << tokens[1] << std::endl;
+      return true;
+    }
+    out << "[OK] Cache " << tokens[1] << std::endl;
+  } else if (tokens[0] == "e" && tokens.size() >= 4) {
+    std::string token = tokens[1];
+    std::string filename = tokens[3];
+
+    if (token[0] != '$') {
+      out << "\n-- Invalid command! --" << std::endl;
+      return true;
+    }
 
-      Image *imagePtr = tokenPtr->getPtr();
-      *imagePtr = rotate(*imagePtr, times);
-      std::cout << "[OK] Rotate " << token << std::endl;
-    } else if (tokens[0] == "s" && tokens.size() >= 4) {
-      std::string token = tokens[1];
+    Token *tokenPtr = findToken(database.tokens, token);
 
-      if (token[0] != '$') {
-        std::cout << "\n-- Invalid command! --" << std::endl;
-        continue;
-      }
+    if (tokenPtr == nullptr) {
+      out << "[ERROR] Token " << token << " not found!" << std::endl;
+      return true;
+    }
 
-      Token *tokenPtr = findToken(tokenDatabase, token);
-      if (tokenPtr == nullptr) {
-        std::cout << "[ERROR] Token " << token << " not found!" << std::endl;
-        continue;
+    if (isSharedMemoryName(filename)) {
+      if ((!tokenPtr->isDeferred() || materializeToken(*tokenPtr, out)) &&
+          exportSharedImage(tokenPtr->getPtr(), filename, out)) {
+        out << "[OK] Export " << token << std::endl;
       }
+      return true;
+    }
 
-      double factor = std::stod(tokens[3]);
-
-      Image *imagePtr = tokenPtr->getPtr();
-      *imagePtr = resize(*imagePtr, factor);
-      std::cout << "[OK] Scale " << token << std::endl;
-    } else if (tokens[0] == "g" && tokens.size() >= 2) {
-      std::string token = tokens[1];
+    if (fileExists(filename)) {
+      out << "[ERROR] File exists" << std::endl;
+      return true;
+    }
 
-      if (token[0] != '$') {
-        std::cout << "\n-- Invalid command! --" << std::endl;
-        continue;
+    std::string cacheKey;
+    if (database.cache.isOpen() && !tokenPtr->getHistory().empty()) {
+      cacheKey = resultCacheKey(tokenPtr->getHistory(),
+                                hasExtension(filename, ".qoi") ? "qoi" : "pnm");
+      if (database.cache.fetch(cacheKey, filename)) {
+        out << "[OK] Export " << token << std::endl;
+        return true;
       }
+    }
+    if (tokenPtr->isDeferred() && !materializeToken(*tokenPtr, out)) {
+      return true;
+    }
 
-      Token *tokenPtr = findToken(tokenDatabase, token);
-      if (tokenPtr == nullptr) {
-        std::cout << "[ERROR] Token " << token << " not found!" << std::endl;
-        continue;
+    bool success = false;
+    Image *imagePtr = tokenPtr->getPtr();
+    if (hasExtension(filename, ".qoi")) {
+      if (imagePtr->isWide()) {
+        out << "[ERROR] QOI holds 8-bit samples only" << std::endl;
+        return true;
       }
-
-      Image *imagePtr = tokenPtr->getPtr();
-      if (dynamic_cast<GSCImage *>(imagePtr)) {
-        std::cout << "[NOP] Already grayscale " << token << std::endl;
-      } else if (dynamic_cast<RGBImage *>(imagePtr)) {
-        RGBImage *rgbImage = static_cast<RGBImage *>(imagePtr);
-        GSCImage *gscImage = new GSCImage(*rgbImage);
-        delete rgbImage;
-        tokenPtr->setPtr(gscImage);
-        std::cout << "[OK] Grayscale " << token << std::endl;
+      if (static_cast<uint32_t>(imagePtr->getWidth()) > qoiMaxSide ||
+          static_cast<uint32_t>(imagePtr->getHeight()) > qoiMaxSide) {
+        out << "[ERROR] Image too large for QOI" << std::endl;
+        return true;
+      }
+      if (dynamic_cast<YUVImage *>(imagePtr)) {
+        // The conversion consumes its source, so it gets a copy
+        RGBImage rgbImage(*new YUVImage(*static_cast<YUVImage *>(imagePtr)));
+        success = exportQOIImage(&rgbImage, filename, out);
+      } else {
+        success = exportQOIImage(imagePtr, filename, out);
       }
+    } else if (dynamic_cast<GSCImage *>(imagePtr)) {
+      success =
+          exportPGMImage(static_cast<GSCImage *>(imagePtr), filename, out);
+    } else if (dynamic_cast<RGBImage *>(imagePtr)) {
+      success =
+          exportPPMImage(static_cast<RGBImage *>(imagePtr), filename, out);
+    } else if (dynamic_cast<YUVImage *>(imagePtr)) {
+      success =
+          exportYUVImage(static_cast<YUVImage *>(imagePtr), filename, out);
     }
-    else if (tokens[0] == "m" && tokens.size() >= 2) {
-      std::string token = tokens[1];
 
-      if (token[0] != '$') {
-        std::cout << "\n-- Invalid command! --" << std::endl;
-        continue;
+    if (success) {
+      if (!cacheKey.empty()) {
+        database.cache.store(cacheKey, filename);
       }
+      out << "[OK] Export " << token << std::endl;
+    } else {
+      out << "[ERROR] Unable to create file" << std::endl;
+    }
+  }
+  return true;
+}
 
-      Token *tokenPtr = findToken(tokenDatabase, token);
-      if (tokenPtr == nullptr) {
-        std::cout << "[ERROR] Token " << token << " not found!" << std::endl;
-        continue;
-      }
+#if defined(__unix__) || defined(__APPLE__)
+bool sendAll(int socketFd, const std::string &data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t count = send(socketFd, data.data() + sent, data.size() - sent, 0);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      return false;
+    }
+    sent += count;
+  }
+  return true;
+}
 
-      Image *imagePtr = tokenPtr->getPtr();
-      *imagePtr = mirrorVertical(*imagePtr);
-      std::cout << "[OK] Mirror " << token << std::endl;
+// One client of the daemon: commands arrive one per line and each reply is
+// sent back as a whole once its command has finished. `q` ends the session
+// but keeps the tokens.
+void serveClient(int client, TokenDatabase &database) {
+  static std::atomic<int> clients(0);
+  currentClient = ++clients;
+  std::string pending;
+  char buffer[4096];
+  bool open = true;
+  while (open) {
+    ssize_t received = recv(client, buffer, sizeof(buffer), 0);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      break;
     }
-    if (tokens[0] == "n" && tokens.size() >= 2) {
-      std::string token = tokens[1];
+    pending.append(buffer, received);
 
-      if (token[0] != '$') {
-        std::cout << "\n-- Invalid command! --" << std::endl;
+    size_t newline;
+    while (open && (newline = pending.find('\n')) != std::string::npos) {
+      std::vector<std::string> tokens = splitCommand(pending.substr(0, newline));
+      pending.erase(0, newline + 1);
+      if (tokens.empty()) {
         continue;
       }
 
-      Token *tokenPtr = findToken(tokenDatabase, token);
-      if (tokenPtr == nullptr) {
-        std::cout << "[ERROR] Token " << token << " not found!" << std::endl;
-        continue;
+      // A malformed number must not take down every other client
+      std::ostringstream reply;
+      try {
+        open = executeCommand(tokens, database, reply);
+      } catch (const std::exception &) {
+        reply << "\n-- Invalid command! --" << std::endl;
       }
+      open = sendAll(client, reply.str()) && open;
+    }
+  }
+  database.jobs.detachClient(currentClient);
+  close(client);
+}
 
-      Image *imagePtr = tokenPtr->getPtr();
-      *imagePtr = reverseBrightness(*imagePtr);
-      std::cout << "[OK] Color Inversion " << token << std::endl;
-    } else if (tokens[0] == "d") {
-      std::string token = tokens[1];
-      deleteToken(tokenDatabase, token);
-    } else if (tokens[0] == "q") {
-      for (const Token &token : tokenDatabase) {
-        delete token.getPtr();
-      }
-      tokenDatabase.clear();
-      break;
-    } else if (tokens[0] == "z" && tokens.size() >= 2) {
-      std::string token = tokens[1];
+int serveDaemon(const char *path) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (std::strlen(path) >= sizeof(address.sun_path)) {
+    std::cout << "[ERROR] Socket path too long" << std::endl;
+    return 1;
+  }
+  std::strcpy(address.sun_path, path);
 
-      if (token[0] != '$') {
-        std::cout << "\n-- Invalid command! --" << std::endl;
-        continue;
-      }
+  // Replace the socket of an earlier daemon, but never a regular file
+  struct stat info;
+  if (lstat(path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+    unlink(path);
+  }
 
-      Token *tokenPtr = findToken(tokenDatabase, token);
-      if (tokenPtr == nullptr) {
-        std::cout << "[ERROR] Token " << token << " not found!" << std::endl;
-        continue;
-      }
+  int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server < 0 ||
+      bind(server, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+      listen(server, SOMAXCONN) != 0) {
+    std::cout << "[ERROR] Unable to listen on " << path << std::endl;
+    return 1;
+  }
 
-      Image *imagePtr = tokenPtr->getPtr();
-      if (dynamic_cast<GSCImage *>(imagePtr)) {
-        GSCImage *gscImage = static_cast<GSCImage *>(imagePtr);
-		RGBImage *rgbImage = new RGBImage(*gscImage);
-		YUVImage *yuvImage = new YUVImage(*rgbImage);
-        histogramEqualization(*yuvImage);
-		*rgbImage = RGBImage(*yuvImage);
-		GSCImage *gscImage2 = new GSCImage(*rgbImage,afterEq);
-		delete rgbImage;
-		tokenPtr->setPtr(gscImage2);
-        std::cout << "[OK] Equalize " << token << std::endl;
-      } else if (dynamic_cast<RGBImage *>(imagePtr)) {
-        RGBImage *rgbImage = static_cast<RGBImage *>(imagePtr);
-        YUVImage *yuvImage = new YUVImage(*rgbImage);
-        histogramEqualization(*yuvImage);
-		*rgbImage = RGBImage(*yuvImage);
-		tokenPtr->setPtr(rgbImage);
-        std::cout << "[OK] Equalize " << token << std::endl;
-      }
-    } else if (tokens[0] == "e" && tokens.size() >= 4) {
-      std::string token = tokens[1];
-      std::string filename = tokens[3];
-
-      if (token[0] != '$') {
-        std::cout << "\n-- Invalid command! --" << std::endl;
+  // Clients that hang up mid-reply are handled by sendAll()
+  std::signal(SIGPIPE, SIG_IGN);
+  std::cout << "[OK] Listening on " << path << std::endl;
+
+  TokenDatabase database;
+  while (true) {
+    int client = accept(server, nullptr, nullptr);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
         continue;
       }
+      std::cout << "[ERROR] Unable to accept clients" << std::endl;
+      close(server);
+      return 1;
+    }
+    std::thread(serveClient, client, std::ref(database)).detach();
+  }
+}
 
-      Token *tokenPtr = findToken(tokenDatabase, token);
+// Forwards standard input to a daemon line by line and prints its replies,
+// so scripts written for the interactive mode run unchanged.
+int runClient(const char *path) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (std::strlen(path) >= sizeof(address.sun_path)) {
+    std::cout << "[ERROR] Socket path too long" << std::endl;
+    return 1;
+  }
+  std::strcpy(address.sun_path, path);
 
-      if (tokenPtr == nullptr) {
-        std::cout << "[ERROR] Token " << token << " not found!" << std::endl;
-        continue;
+  int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server < 0 ||
+      connect(server, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+    std::cout << "[ERROR] Unable to connect to " << path << std::endl;
+    return 1;
+  }
+  std::signal(SIGPIPE, SIG_IGN);
+
+  std::thread replies([server] {
+    char buffer[4096];
+    ssize_t received;
+    while ((received = recv(server, buffer, sizeof(buffer), 0)) > 0 ||
+           (received < 0 && errno == EINTR)) {
+      if (received > 0) {
+        std::cout.write(buffer, received);
+        std::cout.flush();
       }
+    }
+  });
 
-      if (fileExists(filename)) {
-        std::cout << "[ERROR] File exists" << std::endl;
-        continue;
-      }
+  std::string line;
+  while (std::getline(std::cin, line) && sendAll(server, line + "\n")) {
+  }
+  shutdown(server, SHUT_WR);
+  replies.join();
+  close(server);
+  return 0;
+}
+#else
+int serveDaemon(const char *path) {
+  std::cout << "[ERROR] Daemon mode needs Unix domain sockets" << std::endl;
+  return 1;
+}
 
-      bool success = false;
-      Image *imagePtr = tokenPtr->getPtr();
-      if (dynamic_cast<GSCImage *>(imagePtr)) {
-        success = exportPGMImage(static_cast<GSCImage *>(imagePtr), filename);
-      } else if (dynamic_cast<RGBImage *>(imagePtr)) {
-        success = exportPPMImage(static_cast<RGBImage *>(imagePtr), filename);
-      } else if (dynamic_cast<YUVImage *>(imagePtr)) {
-        success = exportYUVImage(static_cast<YUVImage *>(imagePtr), filename);
-      }
+int runClient(const char *path) { return serveDaemon(path); }
+#endif
 
-      if (success) {
-        std::cout << "[OK] Export " << token << std::endl;
-      } else {
-        std::cout << "[ERROR] Unable to create file" << std::endl;
-      }
+int main(int argc, char **argv) {
+  if (argc >= 3 && std::string(argv[1]) == "--daemon") {
+    return serveDaemon(argv[2]);
+  }
+  if (argc >= 3 && std::string(argv[1]) == "--connect") {
+    return runClient(argv[2]);
+  }
+
+  TokenDatabase database;
+  std::string line;
+  while (std::getline(std::cin, line)) {
+    std::vector<std::string> tokens = splitCommand(line);
+    if (tokens.empty()) {
+      continue;
+    }
+    if (!executeCommand(tokens, database, std::cout)) {
+      break;
     }
   }
 
+  database.jobs.shutdown();
+  for (Token &token : database.tokens) {
+    token.releaseImage();
+  }
+  database.tokens.clear();
+  bufferPool().trim();
   return 0;
 }
\ No newline at end of file